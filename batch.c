@@ -0,0 +1,189 @@
+/*
+ * Batch runner: independent headless games spread over a work-stealing pool,
+ * one game per task, so that long games never leave the other threads idle.
+ * Game i is seeded with the base seed plus i as in headless_play, and every
+ * game owns its board, shape stream and search context, so results do not
+ * depend on the number of threads. Per-game results are streamed to CSV or
+ * JSON lines files as games finish, and the lines cleared are summarized by
+ * their mean and percentiles. Games finish in any order, so each is recorded
+ * to a trace of its own, FILE.N for game N.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "tetris.h"
+
+typedef struct {
+    float *w;
+    search_opts_t opts;
+    int max_pieces, n_games;
+    int *lines, *pieces;
+
+    pthread_mutex_t lock; /* the sinks and the merged search stats */
+    FILE *csv, *json;
+    search_stats_t search;
+    int n_done;
+
+    const char *record_file;
+    bool record_ok;
+} batch_t;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void game_task(void *arg, int worker, int task)
+{
+    (void) worker;
+    batch_t *b = arg;
+
+    search_opts_t opts = b->opts;
+    opts.seed = b->opts.seed + task;
+    trace_t *rec = NULL;
+    char path[4096];
+    if (b->record_file) {
+        snprintf(path, sizeof(path), "%s.%d", b->record_file, task + 1);
+        rec = trace_create(path, opts.height ? opts.height : GRID_HEIGHT,
+                           opts.width ? opts.width : GRID_WIDTH, opts.seed,
+                           opts.bag, true);
+    }
+
+    game_stats_t st;
+    double start = now();
+    headless_game(b->w, &opts, b->max_pieces, NULL, rec, false, &st);
+    double elapsed = now() - start;
+    b->lines[task] = st.n_lines;
+    b->pieces[task] = st.n_pieces;
+    bool rec_ok = !b->record_file || (rec && trace_close(rec));
+
+    pthread_mutex_lock(&b->lock);
+    if (!rec_ok && b->record_ok) {
+        fprintf(stderr, "Failed to write the trace to %s\n", path);
+        b->record_ok = false;
+    }
+    if (b->csv)
+        fprintf(b->csv, "%d,%llu,%d,%d,%.6f\n", task + 1,
+                (unsigned long long) opts.seed, st.n_lines, st.n_pieces,
+                elapsed);
+    if (b->json)
+        fprintf(b->json,
+                "{\"game\":%d,\"seed\":%llu,\"lines\":%d,\"pieces\":%d,"
+                "\"seconds\":%.6f}\n",
+                task + 1, (unsigned long long) opts.seed, st.n_lines,
+                st.n_pieces, elapsed);
+    search_stats_merge(&b->search, &st.search);
+    /* SIGUSR1 is served as games finish, with the games done so far */
+    b->n_done++;
+    if (stats_requested()) {
+        fprintf(stderr, "games %d of %d\n", b->n_done, b->n_games);
+        search_stats_print(stderr, &b->search);
+    }
+    pthread_mutex_unlock(&b->lock);
+}
+
+static int by_value(const void *a, const void *b)
+{
+    int x = *(const int *) a, y = *(const int *) b;
+    return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile p of the n sorted values */
+static int percentile(const int *sorted, int n, int p)
+{
+    int rank = (p * n + 99) / 100;
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static FILE *sink_open(const char *path, const char *header)
+{
+    if (!path)
+        return NULL;
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        return NULL;
+    }
+    /* Whole lines at a time, so that a run can be followed as it goes */
+    setvbuf(f, NULL, _IOLBF, 0);
+    if (header)
+        fputs(header, f);
+    return f;
+}
+
+bool batch_play(float *w,
+                const search_opts_t *opts,
+                int n_games,
+                int max_pieces,
+                int n_jobs,
+                const char *csv_file,
+                const char *json_file,
+                const char *record_file)
+{
+    batch_t b = {
+        .w = w,
+        .opts = *opts,
+        .max_pieces = max_pieces,
+        .n_games = n_games,
+        .lines = calloc(n_games, sizeof(int)),
+        .pieces = calloc(n_games, sizeof(int)),
+        .csv = sink_open(csv_file, "game,seed,lines,pieces,seconds\n"),
+        .json = sink_open(json_file, NULL),
+        .record_file = record_file,
+        .record_ok = true,
+    };
+    /* Parallelism comes from running games side by side */
+    b.opts.n_threads = 1;
+    pthread_mutex_init(&b.lock, NULL);
+    bool ok = b.lines && b.pieces && (!csv_file || b.csv) &&
+              (!json_file || b.json);
+
+    if (ok) {
+        printf("seed %llu%s games %d jobs %d\n",
+               (unsigned long long) opts->seed, opts->bag ? " bag" : "",
+               n_games, n_jobs);
+        double start = now();
+        pool_t *pool = pool_new(n_jobs);
+        pool_run(pool, n_games, game_task, &b);
+        pool_free(pool);
+        double elapsed = now() - start;
+
+        long total_pieces = 0, total_lines = 0;
+        for (int i = 0; i < n_games; i++) {
+            total_pieces += b.pieces[i];
+            total_lines += b.lines[i];
+        }
+        qsort(b.lines, n_games, sizeof(int), by_value);
+        printf("lines: mean %.1f min %d p10 %d p25 %d median %d p75 %d "
+               "p90 %d p99 %d max %d\n",
+               (double) total_lines / n_games, b.lines[0],
+               percentile(b.lines, n_games, 10),
+               percentile(b.lines, n_games, 25),
+               percentile(b.lines, n_games, 50),
+               percentile(b.lines, n_games, 75),
+               percentile(b.lines, n_games, 90),
+               percentile(b.lines, n_games, 99), b.lines[n_games - 1]);
+        printf("total: games %d lines %ld pieces %ld time %.3fs "
+               "pieces/sec %.1f\n",
+               n_games, total_lines, total_pieces, elapsed,
+               elapsed > 0 ? total_pieces / elapsed : 0);
+        search_stats_print(stdout, &b.search);
+    }
+
+    if (!b.record_ok)
+        ok = false;
+    if (b.csv && fclose(b.csv))
+        ok = false;
+    if (b.json && fclose(b.json))
+        ok = false;
+    pthread_mutex_destroy(&b.lock);
+    free(b.lines);
+    free(b.pieces);
+    free_shape();
+    return ok;
+}
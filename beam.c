@@ -0,0 +1,189 @@
+/*
+ * Beam search over the preview.
+ *
+ * Instead of the exhaustive depth-first search, expand the preview one piece
+ * at a time and only keep the beam_width best boards (by grid_eval) of every
+ * level. The cost per move is bounded by
+ *   depth * beam_width * (rotations * columns)
+ * placements, whatever the preview length. With a beam at least as wide as
+ * any level, it finds the same best leaf as the exhaustive search.
+ */
+
+#include <float.h>
+
+#include "nalloc.h"
+#include "tetris.h"
+
+typedef struct {
+    float score;
+    move_t root; /* placement of the first piece that led to this board */
+    grid_t *g;
+} beam_node_t;
+
+struct beam {
+    int width;
+    beam_node_t *levels[2];
+    char *grids; /* boards of both levels, in one array */
+    int *heap; /* min-heap by score of indices into the next level */
+    grid_t *cleared;
+    search_stats_t st;
+};
+
+beam_t *beam_new(int height, int width, int beam_width, void *parent)
+{
+    beam_t *bm = ncalloc(1, sizeof(*bm), parent);
+    bm->width = beam_width;
+    size_t size = grid_size(height, width);
+    bm->grids = nalloc(2 * beam_width * size, bm);
+    for (int l = 0; l < 2; l++) {
+        bm->levels[l] = ncalloc(beam_width, sizeof(*bm->levels[l]), bm);
+        for (int i = 0; i < beam_width; i++) {
+            void *mem = bm->grids + (l * beam_width + i) * size;
+            bm->levels[l][i].g = grid_init(mem, height, width);
+        }
+    }
+    bm->heap = ncalloc(beam_width, sizeof(*bm->heap), bm);
+    bm->cleared = grid_new(height, width);
+    nalloc_set_parent(bm->cleared, bm);
+    return bm;
+}
+
+static void heap_sift_down(int *heap, int n, const beam_node_t *nodes, int i)
+{
+    for (;;) {
+        int l = 2 * i + 1, r = l + 1, min = i;
+        if (l < n && nodes[heap[l]].score < nodes[heap[min]].score)
+            min = l;
+        if (r < n && nodes[heap[r]].score < nodes[heap[min]].score)
+            min = r;
+        if (min == i)
+            return;
+        int tmp = heap[i];
+        heap[i] = heap[min];
+        heap[min] = tmp;
+        i = min;
+    }
+}
+
+static void heap_sift_up(int *heap, const beam_node_t *nodes, int i)
+{
+    while (i) {
+        int parent = (i - 1) / 2;
+        if (nodes[heap[parent]].score <= nodes[heap[i]].score)
+            return;
+        int tmp = heap[i];
+        heap[i] = heap[parent];
+        heap[parent] = tmp;
+        i = parent;
+    }
+}
+
+/* Offer a board to the next level, evicting its worst board when full */
+static void beam_push(beam_t *bm,
+                      beam_node_t *nodes,
+                      int *n,
+                      const grid_t *g,
+                      float score,
+                      move_t root)
+{
+    int slot;
+    if (*n < bm->width) {
+        slot = *n;
+    } else if (score > nodes[bm->heap[0]].score) {
+        slot = bm->heap[0];
+    } else {
+        return;
+    }
+
+    beam_node_t *node = &nodes[slot];
+    grid_cpy(node->g, g);
+    STATS_ADD(&bm->st, grid_cpys, 1);
+    node->score = score;
+    node->root = root;
+
+    if (*n < bm->width) {
+        bm->heap[*n] = slot;
+        heap_sift_up(bm->heap, nodes, *n);
+        (*n)++;
+    } else {
+        heap_sift_down(bm->heap, *n, nodes, 0);
+    }
+}
+
+float beam_search(beam_t *bm,
+                  grid_t *g,
+                  const shape_t **seq,
+                  int depth,
+                  const float *w,
+                  move_t *best)
+{
+    beam_node_t *cur = bm->levels[0], *next = bm->levels[1];
+    grid_cpy(cur[0].g, g);
+    STATS_ADD(&bm->st, grid_cpys, 1);
+    int n_cur = 1;
+
+    for (int d = 0; d < depth && n_cur; d++) {
+        const shape_t *s = seq[d];
+        int n_next = 0;
+        int elevated = g->height - s->max_dim_len;
+
+        for (int i = 0; i < n_cur; i++) {
+            grid_t *parent = cur[i].g;
+            bool nocheck =
+                (g->height - 1 - parent->relief_max) >= s->max_dim_len;
+            STATS_ADD(&bm->st,
+                      nodes[d < STATS_DEPTHS ? d : STATS_DEPTHS - 1], 1);
+
+            for (int r = 0; r < s->n_rot; r++) {
+                const placement_t *p = s->place[r];
+                const placement_t *end = p + g->width - s->rot_wh[r].x + 1;
+                if (nocheck)
+                    STATS_ADD(&bm->st, nocheck_skips, end - p);
+                else
+                    STATS_ADD(&bm->st, intersect_tests, end - p);
+                for (; p < end; p++) {
+                    if (!nocheck && grid_place_intersects(parent, p, elevated))
+                        continue;
+
+                    int land = grid_place_drop(parent, p, elevated);
+                    grid_place_add(parent, p, land);
+                    grid_t *child = parent;
+                    if (parent->n_full_rows) {
+                        child = bm->cleared;
+                        grid_cpy(child, parent);
+                        grid_clear_lines(child);
+                        STATS_ADD(&bm->st, grid_cpys, 1);
+                        STATS_ADD(&bm->st, clears, 1);
+                    }
+
+                    float score = grid_eval(child, w);
+                    STATS_ADD(&bm->st, leaves, 1);
+                    move_t root =
+                        d ? cur[i].root : (move_t){s, p->rot, p->col};
+                    beam_push(bm, next, &n_next, child, score, root);
+
+                    grid_place_remove(parent, p, land);
+                }
+            }
+        }
+
+        beam_node_t *tmp = cur;
+        cur = next;
+        next = tmp;
+        n_cur = n_next;
+    }
+
+    float score = -FLT_MAX;
+    for (int i = 0; i < n_cur; i++) {
+        if (cur[i].score > score) {
+            score = cur[i].score;
+            *best = cur[i].root;
+        }
+    }
+    return score;
+}
+
+void beam_stats_add(const beam_t *bm, search_stats_t *st)
+{
+    search_stats_merge(st, &bm->st);
+}
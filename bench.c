@@ -0,0 +1,932 @@
+/*
+ * Microbenchmarks of the grid and search primitives, run by `make bench`.
+ *
+ * Every benchmark walks the boards of a recorded corpus (data/boards), so
+ * that the numbers of two commits compare. The output is one line per
+ * benchmark, tab separated:
+ *
+ *   name	ns/op	ops
+ *
+ * preceded by '#' lines describing the build. With --record N, play seeded
+ * games instead and write a corpus of N of their boards to stdout. With
+ * --check, run self-checks of the fast paths on the corpus instead, one
+ * line each:
+ *
+ *   name	ok|FAIL	failures	cases
+ */
+
+#include <float.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "nalloc.h"
+#include "tetris.h"
+
+#define BENCH_MAX_CASES (1 << 15)
+#define BENCH_DEPTH 3
+
+/* A board of the corpus, with the pieces to search on it */
+typedef struct {
+    grid_t *g;
+    const shape_t *seq[BENCH_DEPTH];
+} board_t;
+
+/* A block at some position of some board */
+typedef struct {
+    board_t *board;
+    block_t b;
+} bench_case_t;
+
+typedef struct {
+    const char *name;
+    int64_t (*run)(int arg, long rounds, long *ops);
+    int arg;
+} bench_t;
+
+/* A self-check: return the number of failed cases out of *cases */
+typedef struct {
+    const char *name;
+    long (*run)(int arg, long *cases);
+    int arg;
+} check_t;
+
+static board_t *boards;
+static int n_boards;
+
+/* Blocks at the spawn height, dropped through relief alone, and blocks under
+ * some column top, dropped by the row scan.
+ */
+static bench_case_t drop_fast[BENCH_MAX_CASES], drop_scan[BENCH_MAX_CASES];
+static int n_drop_fast, n_drop_scan;
+
+/* Blocks where drop_fast ones land */
+static bench_case_t landed[BENCH_MAX_CASES];
+static int n_landed;
+
+/* Per corpus board, the same board over 1 .. 4 full rows */
+static grid_t **clear_src[MAX_BLOCK_LEN + 1];
+
+static float *weights;
+static volatile long sink;
+
+static inline int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Board files hold boards as
+ *
+ *   board WIDTH HEIGHT PIECE...
+ *   ..#.......
+ *   ###.######
+ *
+ * with rows from top to bottom ending at row 0, '#' for occupied cells, and
+ * pieces as indices into the shape set. Lines starting with '#' are comments.
+ */
+static bool boards_load(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return false;
+
+    char line[256];
+    int cap = 0;
+    char rows[GRID_MAX_HEIGHT][256];
+    int n_rows = 0;
+    board_t *cur = NULL;
+
+    for (bool eof = false; !eof;) {
+        eof = !fgets(line, sizeof(line), f);
+        if (!eof && line[0] == '#')
+            continue;
+
+        int width, height, p[BENCH_DEPTH];
+        bool header = !eof && sscanf(line, "board %d %d %d %d %d", &width,
+                                     &height, &p[0], &p[1], &p[2]) == 5;
+        if (!eof && !header) {
+            line[strcspn(line, "\n")] = '\0';
+            if (line[0] && cur && n_rows < cur->g->height)
+                strcpy(rows[n_rows++], line);
+            continue;
+        }
+
+        /* A header or the end of the file completes the previous board */
+        if (cur) {
+            for (int i = 0; i < n_rows; i++) {
+                int r = n_rows - 1 - i;
+                for (int c = 0; c < cur->g->width && rows[i][c]; c++) {
+                    if (rows[i][c] == '#')
+                        grid_cell_set(cur->g, r, c);
+                }
+            }
+            cur = NULL;
+        }
+        if (eof)
+            break;
+
+        if (width < 4 || width > GRID_ROW_BITS || height < 4 ||
+            height > GRID_MAX_HEIGHT) {
+            fprintf(stderr, "%s: unsupported board size %dx%d\n", path, width,
+                    height);
+            fclose(f);
+            return false;
+        }
+        if (n_boards == cap) {
+            cap = cap ? 2 * cap : 64;
+            boards = realloc(boards, cap * sizeof(*boards));
+        }
+        cur = &boards[n_boards++];
+        cur->g = grid_new(height, width);
+        for (int i = 0; i < BENCH_DEPTH; i++)
+            cur->seq[i] = shape_get(p[i] % shapes_count());
+        n_rows = 0;
+    }
+
+    fclose(f);
+    return n_boards > 0;
+}
+
+static void boards_save(FILE *f, const grid_t *g, const shape_t **seq)
+{
+    fprintf(f, "board %d %d", g->width, g->height);
+    for (int i = 0; i < BENCH_DEPTH; i++)
+        fprintf(f, " %d", (int) (seq[i] - shape_get(0)));
+    fprintf(f, "\n");
+
+    int top = g->height - 1;
+    while (top > 0 && !g->rows[top])
+        top--;
+    for (int r = top; r >= 0; r--) {
+        for (int c = 0; c < g->width; c++)
+            fputc(g->rows[r] & (row_t) 1 << c ? '#' : '.', f);
+        fputc('\n', f);
+    }
+    fputc('\n', f);
+}
+
+/* Play games from seed, and write a board of them every few pieces */
+static void boards_record(FILE *f, int n, unsigned seed)
+{
+    const int every = 25, max_pieces = 2000;
+
+    fprintf(f, "# Board corpus for tetris-bench, recorded with --seed %u\n\n",
+            seed);
+    search_ctx_t *ctx =
+        search_ctx_new(GRID_HEIGHT, GRID_WIDTH, SS_DEFAULT_LEN, NULL);
+    block_t *b = block_new();
+
+    while (n > 0) {
+        grid_t *g = grid_new(GRID_HEIGHT, GRID_WIDTH);
+        shape_stream_t *ss = shape_stream_new(BENCH_DEPTH, seed++, false);
+        for (int i = 0; i < max_pieces && n > 0; i++) {
+            shape_stream_pop(ss);
+            const shape_t *seq[BENCH_DEPTH];
+            for (int j = 0; j < BENCH_DEPTH; j++)
+                seq[j] = shape_stream_peek(ss, j);
+            if (i % every == every - 1) {
+                boards_save(f, g, seq);
+                n--;
+            }
+
+            block_init(b, seq[0]);
+            grid_block_center_elevate(g, b);
+            if (grid_block_intersects(g, b))
+                break;
+            move_t *m = best_move_ctx(ctx, g, ss, weights);
+            if (!m)
+                break;
+            b->rot = m->rot;
+            b->offset.x = m->col;
+            grid_block_drop(g, b);
+            grid_block_add(g, b);
+            grid_clear_lines(g);
+        }
+        nfree(ss);
+        nfree(g);
+    }
+
+    nfree(b);
+    search_ctx_free(ctx);
+}
+
+/* Whether dropping a block from y can be resolved from relief alone */
+static bool drop_by_relief(const grid_t *g, const placement_t *p, int y)
+{
+    for (int i = 0; i < p->n_crust; i++) {
+        if (y + p->crust[i][1] <= g->relief[p->crust[i][0]])
+            return false;
+    }
+    return true;
+}
+
+static void case_add(bench_case_t *cases,
+                     int *n,
+                     board_t *board,
+                     const shape_t *s,
+                     int rot,
+                     int col,
+                     int y)
+{
+    if (*n == BENCH_MAX_CASES)
+        return;
+    bench_case_t *bc = &cases[(*n)++];
+    bc->board = board;
+    block_init(&bc->b, s);
+    bc->b.rot = rot;
+    bc->b.offset.x = col;
+    bc->b.offset.y = y;
+}
+
+/* Enumerate every placement of every shape on every board */
+static void cases_init(void)
+{
+    for (int i = 0; i < n_boards; i++) {
+        board_t *board = &boards[i];
+        grid_t *g = board->g;
+        for (int k = 0; k < shapes_count(); k++) {
+            const shape_t *s = shape_get(k);
+            int elevated = g->height - s->max_dim_len;
+            for (int r = 0; r < s->n_rot; r++) {
+                for (int c = 0; c + s->rot_wh[r].x <= g->width; c++) {
+                    const placement_t *p = &s->place[r][c];
+                    if (!grid_place_intersects(g, p, elevated)) {
+                        case_add(drop_fast, &n_drop_fast, board, s, r, c,
+                                 elevated);
+                        case_add(landed, &n_landed, board, s, r, c,
+                                 grid_place_drop(g, p, elevated));
+                    }
+                    for (int y = 0; y < elevated; y++) {
+                        if (!grid_place_intersects(g, p, y) &&
+                            !drop_by_relief(g, p, y))
+                            case_add(drop_scan, &n_drop_scan, board, s, r, c,
+                                     y);
+                    }
+                }
+            }
+        }
+    }
+
+    /* Lay each board over k full rows of all but column 0, and drop a
+     * vertical I into that column to complete k of them.
+     */
+    const placement_t *bar = NULL;
+    for (int k = 0; k < shapes_count() && !bar; k++) {
+        const shape_t *s = shape_get(k);
+        for (int r = 0; r < s->n_rot; r++) {
+            if (s->rot_wh[r].x == 1 && s->rot_wh[r].y == MAX_BLOCK_LEN)
+                bar = &s->place[r][0];
+        }
+    }
+    if (!bar)
+        return;
+    for (int k = 1; k <= MAX_BLOCK_LEN; k++) {
+        clear_src[k] = calloc(n_boards, sizeof(*clear_src[k]));
+        for (int i = 0; i < n_boards; i++) {
+            const grid_t *src = boards[i].g;
+            grid_t *g = grid_new(src->height, src->width);
+            for (int r = 0; r < k; r++) {
+                for (int c = 1; c < g->width; c++)
+                    grid_cell_set(g, r, c);
+            }
+            for (int r = 0; r + MAX_BLOCK_LEN < g->height; r++) {
+                for (int c = 1; c < g->width; c++) {
+                    if (src->rows[r] & (row_t) 1 << c)
+                        grid_cell_set(g, r + MAX_BLOCK_LEN, c);
+                }
+            }
+            grid_place_add(g, bar, 0);
+            clear_src[k][i] = g;
+        }
+    }
+}
+
+static int64_t bench_add_remove(int arg, long rounds, long *ops)
+{
+    (void) arg;
+    int64_t start = now_ns();
+    for (long n = 0; n < rounds; n++) {
+        for (int i = 0; i < n_landed; i++) {
+            grid_t *g = landed[i].board->g;
+            grid_block_add(g, &landed[i].b);
+            grid_block_remove(g, &landed[i].b);
+        }
+    }
+    *ops = rounds * n_landed;
+    return now_ns() - start;
+}
+
+static int64_t bench_drop(int arg, long rounds, long *ops)
+{
+    bench_case_t *cases = arg ? drop_scan : drop_fast;
+    int n_cases = arg ? n_drop_scan : n_drop_fast;
+    long sum = 0;
+
+    int64_t start = now_ns();
+    for (long n = 0; n < rounds; n++) {
+        for (int i = 0; i < n_cases; i++) {
+            block_t b = cases[i].b;
+            sum += grid_block_drop(cases[i].board->g, &b);
+        }
+    }
+    int64_t ns = now_ns() - start;
+
+    sink += sum;
+    *ops = rounds * n_cases;
+    return ns;
+}
+
+/* Clear the copies of a batch of boards, copying them back untimed */
+static int64_t bench_clear(int arg, long rounds, long *ops)
+{
+    static grid_t **work;
+    if (!work) {
+        work = calloc(n_boards, sizeof(*work));
+        for (int i = 0; i < n_boards; i++)
+            work[i] = grid_new(boards[i].g->height, boards[i].g->width);
+    }
+
+    long sum = 0;
+    int64_t ns = 0;
+    for (long n = 0; n < rounds; n++) {
+        for (int i = 0; i < n_boards; i++)
+            grid_cpy(work[i], clear_src[arg][i]);
+        int64_t start = now_ns();
+        for (int i = 0; i < n_boards; i++)
+            sum += grid_clear_lines(work[i]);
+        ns += now_ns() - start;
+    }
+
+    sink += sum;
+    *ops = rounds * n_boards;
+    return ns;
+}
+
+static int64_t bench_cpy(int arg, long rounds, long *ops)
+{
+    (void) arg;
+    grid_t *g = grid_new(boards[0].g->height, boards[0].g->width);
+
+    int64_t start = now_ns();
+    for (long n = 0; n < rounds; n++) {
+        for (int i = 0; i < n_boards; i++)
+            grid_cpy(g, boards[i].g);
+    }
+    int64_t ns = now_ns() - start;
+
+    sink += g->relief_sum;
+    nfree(g);
+    *ops = rounds * n_boards;
+    return ns;
+}
+
+static int64_t bench_eval(int arg, long rounds, long *ops)
+{
+    (void) arg;
+    float sum = 0;
+
+    int64_t start = now_ns();
+    for (long n = 0; n < rounds; n++) {
+        for (int i = 0; i < n_boards; i++)
+            sum += grid_eval(boards[i].g, weights);
+    }
+    int64_t ns = now_ns() - start;
+
+    sink += (long) sum;
+    *ops = rounds * n_boards;
+    return ns;
+}
+
+/* A full search of the first arg pieces of each board */
+static int64_t bench_best_move(int arg, long rounds, long *ops)
+{
+    static search_ctx_t *ctx;
+    if (!ctx)
+        ctx = search_ctx_new(boards[0].g->height, boards[0].g->width,
+                             BENCH_DEPTH, NULL);
+
+    long sum = 0;
+    int64_t start = now_ns();
+    for (long n = 0; n < rounds; n++) {
+        for (int i = 0; i < n_boards; i++) {
+            move_t *m = best_move_seq(ctx, boards[i].g, boards[i].seq, arg,
+                                      weights);
+            sum += m ? m->rot * 16 + m->col : -1;
+        }
+    }
+    int64_t ns = now_ns() - start;
+
+    sink += sum;
+    *ops = rounds * n_boards;
+    return ns;
+}
+
+static const bench_t benches[] = {
+    {"grid_block_add+remove", bench_add_remove, 0},
+    {"grid_block_drop/relief", bench_drop, 0},
+    {"grid_block_drop/scan", bench_drop, 1},
+    {"grid_clear_lines/1", bench_clear, 1},
+    {"grid_clear_lines/2", bench_clear, 2},
+    {"grid_clear_lines/3", bench_clear, 3},
+    {"grid_clear_lines/4", bench_clear, 4},
+    {"grid_cpy", bench_cpy, 0},
+    {"grid_eval", bench_eval, 0},
+    {"best_move/1", bench_best_move, 1},
+    {"best_move/2", bench_best_move, 2},
+    {"best_move/3", bench_best_move, 3},
+};
+
+/* Landing rows of all placements at once against one at a time */
+static long check_drops(int arg, long *cases)
+{
+    (void) arg;
+    long fails = 0;
+    *cases = 0;
+    for (int i = 0; i < n_boards; i++) {
+        const grid_t *g = boards[i].g;
+        for (int k = 0; k < shapes_count(); k++) {
+            const shape_t *s = shape_get(k);
+            int8_t land[4][GRID_ROW_BITS];
+            for (int y = 0; y <= g->height - s->max_dim_len; y++) {
+                grid_place_drops(g, s, y, 0, g->width, land);
+                for (int r = 0; r < s->n_rot; r++) {
+                    for (int c = 0; c + s->rot_wh[r].x <= g->width; c++) {
+                        const placement_t *p = &s->place[r][c];
+                        bool ok = land[r][c] < 0
+                                      ? !drop_by_relief(g, p, y)
+                                      : land[r][c] == grid_place_drop(g, p, y);
+                        fails += !ok;
+                        (*cases)++;
+                    }
+                }
+            }
+        }
+    }
+    return fails;
+}
+
+/* Exhaustive search of the n pieces of seq on copies of the board, cleared
+ * by grid_clear_lines and dropped one placement at a time, as a reference
+ * for the search and its cached drops and undone clears. Ties go to the
+ * first placement in (rot, col) order, as in the search.
+ */
+static float ref_search(const grid_t *g,
+                        const shape_t **seq,
+                        int n,
+                        move_t *best)
+{
+    const shape_t *s = seq[0];
+    int elevated = g->height - s->max_dim_len;
+    grid_t *c = grid_new(g->height, g->width);
+    float score = -FLT_MAX;
+    for (int r = 0; r < s->n_rot; r++) {
+        for (int col = 0; col + s->rot_wh[r].x <= g->width; col++) {
+            const placement_t *p = &s->place[r][col];
+            if (grid_place_intersects(g, p, elevated))
+                continue;
+            grid_cpy(c, g);
+            grid_place_add(c, p, grid_place_drop(c, p, elevated));
+            grid_clear_lines(c);
+            float v = n > 1 ? ref_search(c, seq + 1, n - 1, NULL)
+                            : grid_eval(c, weights);
+            if (v > score) {
+                score = v;
+                if (best)
+                    *best = (move_t){s, r, col};
+            }
+        }
+    }
+    nfree(c);
+    return score;
+}
+
+/* The search of arg pieces against the reference, move and value */
+static long check_best_move(int arg, long *cases)
+{
+    search_ctx_t *ctx = search_ctx_new(boards[0].g->height,
+                                       boards[0].g->width, BENCH_DEPTH, NULL);
+    long fails = 0;
+    for (int i = 0; i < n_boards; i++) {
+        move_t ref = {0};
+        float ref_val = ref_search(boards[i].g, boards[i].seq, arg, &ref);
+        move_t *m =
+            best_move_seq(ctx, boards[i].g, boards[i].seq, arg, weights);
+        bool ok = m ? ref_val == search_ctx_value(ctx) && m->rot == ref.rot &&
+                          m->col == ref.col
+                    : ref_val == -FLT_MAX;
+        fails += !ok;
+    }
+    search_ctx_free(ctx);
+    *cases = n_boards;
+    return fails;
+}
+
+/* Whether two grids of the same size hold the same state, field by field */
+static bool grid_same(const grid_t *a, const grid_t *b)
+{
+    int w = a->width, h = a->height;
+    return a->full_mask == b->full_mask && a->n_full_rows == b->n_full_rows &&
+           a->n_total_cleared == b->n_total_cleared &&
+           a->n_last_cleared == b->n_last_cleared && a->hash == b->hash &&
+           a->relief_sum == b->relief_sum &&
+           a->relief_sq_sum == b->relief_sq_sum &&
+           a->relief_max == b->relief_max && a->gaps_sum == b->gaps_sum &&
+           a->n_relief_steps == b->n_relief_steps &&
+           !memcmp(a->rows, b->rows, h * sizeof(*a->rows)) &&
+           !memcmp(a->cols, b->cols, w * sizeof(*a->cols)) &&
+           !memcmp(a->relief, b->relief, w * sizeof(*a->relief)) &&
+           !memcmp(a->gaps, b->gaps, w * sizeof(*a->gaps)) &&
+           !memcmp(a->relief_cnt, b->relief_cnt,
+                   (h + 1) * sizeof(*a->relief_cnt)) &&
+           !memcmp(a->full_rows, b->full_rows,
+                   a->n_full_rows * sizeof(*a->full_rows));
+}
+
+/* Call fn on every board of the corpus, and on each over 1 .. 4 full rows
+ * but for a vertical I, which clears them
+ */
+static long each_board(long (*fn)(grid_t *g, long *cases), long *cases)
+{
+    long fails = 0;
+    *cases = 0;
+    for (int i = 0; i < n_boards; i++)
+        fails += fn(boards[i].g, cases);
+    for (int k = 1; k <= MAX_BLOCK_LEN; k++) {
+        for (int i = 0; clear_src[k] && i < n_boards; i++)
+            fails += fn(clear_src[k][i], cases);
+    }
+    return fails;
+}
+
+/* Clear g and undo it: the clear must match grid_clear_lines on a copy,
+ * and the undo a copy taken before the clear. Cases are the clears.
+ */
+static long check_undo_clear(grid_t *g, grid_t *before, grid_t *cleared,
+                             long *cases)
+{
+    long fails = 0;
+    grid_cpy(before, g);
+    grid_cpy(cleared, g);
+    grid_clear_lines(cleared);
+
+    grid_undo_t u;
+    if (grid_clear_lines_undoable(g, &u)) {
+        (*cases)++;
+        fails += !grid_same(g, cleared);
+    }
+    grid_clear_lines_undo(g, &u);
+    return fails + !grid_same(g, before);
+}
+
+/* Boards with full rows are cleared as they are, the others after every
+ * placement of every shape, which is then taken back.
+ */
+static long check_undo_board(grid_t *g, long *cases)
+{
+    static grid_t *orig, *placed, *cleared;
+    if (!orig || orig->width != g->width || orig->height != g->height) {
+        nfree(orig), nfree(placed), nfree(cleared);
+        orig = grid_new(g->height, g->width);
+        placed = grid_new(g->height, g->width);
+        cleared = grid_new(g->height, g->width);
+    }
+    if (g->n_full_rows)
+        return check_undo_clear(g, placed, cleared, cases);
+
+    long fails = 0;
+    grid_cpy(orig, g);
+    for (int k = 0; k < shapes_count(); k++) {
+        const shape_t *s = shape_get(k);
+        int elevated = g->height - s->max_dim_len;
+        for (int r = 0; r < s->n_rot; r++) {
+            for (int c = 0; c + s->rot_wh[r].x <= g->width; c++) {
+                const placement_t *p = &s->place[r][c];
+                if (grid_place_intersects(g, p, elevated))
+                    continue;
+                int land = grid_place_drop(g, p, elevated);
+                grid_place_add(g, p, land);
+                fails += check_undo_clear(g, placed, cleared, cases);
+                grid_place_remove(g, p, land);
+                fails += !grid_same(g, orig);
+                grid_cpy(g, orig);
+            }
+        }
+    }
+    return fails;
+}
+
+static long check_undo(int arg, long *cases)
+{
+    (void) arg;
+    return each_board(check_undo_board, cases);
+}
+
+/* Whether the columns of g and all that follows from them match the rows,
+ * recomputed cell by cell
+ */
+static bool grid_cols_ok(const grid_t *g)
+{
+    int sum = 0, sq_sum = 0, mx = -1, gaps_sum = 0, steps = 0;
+    int cnt[GRID_MAX_HEIGHT + 1] = {0};
+    for (int c = 0; c < g->width; c++) {
+        col_t col = 0;
+        int h = -1, filled = 0;
+        for (int r = 0; r < g->height; r++) {
+            if (g->rows[r] & (row_t) 1 << c) {
+                col |= (col_t) 1 << r;
+                h = r;
+                filled++;
+            }
+        }
+        if (g->cols[c] != col || g->relief[c] != h ||
+            g->gaps[c] != h + 1 - filled)
+            return false;
+        sum += h;
+        sq_sum += h * h;
+        mx = h > mx ? h : mx;
+        gaps_sum += h + 1 - filled;
+        cnt[h + 1]++;
+        steps += h != (c ? g->relief[c - 1] : -1);
+    }
+    return g->relief_sum == sum && g->relief_sq_sum == sq_sum &&
+           g->relief_max == mx && g->gaps_sum == gaps_sum &&
+           g->n_relief_steps == steps &&
+           !memcmp(g->relief_cnt, cnt, (g->height + 1) * sizeof(*cnt));
+}
+
+/* The columns of g, then after every placement of every shape, its clear,
+ * and their undoing. Cases are the boards checked.
+ */
+static long check_cols_board(grid_t *g, long *cases)
+{
+    long fails = !grid_cols_ok(g);
+    (*cases)++;
+    grid_undo_t u;
+    if (g->n_full_rows) {
+        grid_clear_lines_undoable(g, &u);
+        fails += !grid_cols_ok(g);
+        grid_clear_lines_undo(g, &u);
+        fails += !grid_cols_ok(g);
+        *cases += 2;
+        return fails;
+    }
+
+    for (int k = 0; k < shapes_count(); k++) {
+        const shape_t *s = shape_get(k);
+        int elevated = g->height - s->max_dim_len;
+        for (int r = 0; r < s->n_rot; r++) {
+            for (int c = 0; c + s->rot_wh[r].x <= g->width; c++) {
+                const placement_t *p = &s->place[r][c];
+                if (grid_place_intersects(g, p, elevated))
+                    continue;
+                int land = grid_place_drop(g, p, elevated);
+                grid_place_add(g, p, land);
+                fails += !grid_cols_ok(g);
+                grid_clear_lines_undoable(g, &u);
+                fails += !grid_cols_ok(g);
+                grid_clear_lines_undo(g, &u);
+                fails += !grid_cols_ok(g);
+                grid_place_remove(g, p, land);
+                fails += !grid_cols_ok(g);
+                *cases += 4;
+            }
+        }
+    }
+    return fails;
+}
+
+static long check_cols(int arg, long *cases)
+{
+    (void) arg;
+    return each_board(check_cols_board, cases);
+}
+
+/* Every eval kernel this CPU runs against the scalar one, and the scalar
+ * one against grid_eval, on g and the boards of every placement of every
+ * shape on it. Cases are the scores compared.
+ */
+static long check_kernels_board(grid_t *g, long *cases)
+{
+    static const char *const names[] = {"avx2", "sse4.1", "neon"};
+    size_t cap = (size_t) shapes_count() * 4 * GRID_ROW_BITS + 1;
+    eval_batch_t *b = eval_batch_new(g->width, cap, NULL);
+    float *ev[2], *ref = nalloc(cap * sizeof(*ref), b);
+    float *out = nalloc(cap * sizeof(*out), b);
+
+    /* The default weights and ones of mixed signs and sizes */
+    float w[2][EVAL_N_WEIGHTS];
+    for (int j = 0; j < 2; j++) {
+        ev[j] = nalloc(cap * sizeof(*ev[j]), b);
+        for (int i = 0; i < EVAL_N_WEIGHTS; i++)
+            w[j][i] = j ? (i % 2 ? -0.37f : 0.37f) * (i + 1) : weights[i];
+    }
+
+    size_t n = eval_batch_push(b, g);
+    for (int j = 0; j < 2; j++)
+        ev[j][n] = grid_eval(g, w[j]);
+    for (int k = 0; k < shapes_count() && !g->n_full_rows; k++) {
+        const shape_t *s = shape_get(k);
+        int elevated = g->height - s->max_dim_len;
+        for (int r = 0; r < s->n_rot; r++) {
+            for (int c = 0; c + s->rot_wh[r].x <= g->width; c++) {
+                const placement_t *p = &s->place[r][c];
+                if (grid_place_intersects(g, p, elevated))
+                    continue;
+                int land = grid_place_drop(g, p, elevated);
+                grid_place_add(g, p, land);
+                grid_undo_t u;
+                grid_clear_lines_undoable(g, &u);
+                n = eval_batch_push(b, g);
+                for (int j = 0; j < 2; j++)
+                    ev[j][n] = grid_eval(g, w[j]);
+                grid_clear_lines_undo(g, &u);
+                grid_place_remove(g, p, land);
+            }
+        }
+    }
+
+    const char *kernel = eval_kernel_name();
+    long fails = 0;
+    for (int j = 0; j < 2; j++) {
+        eval_set_kernel("scalar");
+        grid_eval_batch(w[j], b, b->n, ref);
+        for (size_t i = 0; i < b->n; i++)
+            fails += ref[i] != ev[j][i];
+        *cases += b->n;
+        for (size_t k = 0; k < sizeof(names) / sizeof(names[0]); k++) {
+            if (!eval_set_kernel(names[k]))
+                continue;
+            grid_eval_batch(w[j], b, b->n, out);
+            for (size_t i = 0; i < b->n; i++)
+                fails += ref[i] != out[i];
+            *cases += b->n;
+        }
+    }
+    eval_set_kernel(kernel);
+    nfree(b);
+    return fails;
+}
+
+static long check_kernels(int arg, long *cases)
+{
+    (void) arg;
+    return each_board(check_kernels_board, cases);
+}
+
+static const check_t checks[] = {
+    {"grid_place_drops", check_drops, 0},
+    {"grid_clear_lines_undo", check_undo, 0},
+    {"grid_cols", check_cols, 0},
+    {"eval_boards", check_kernels, 0},
+    {"best_move/2", check_best_move, 2},
+    {"best_move/3", check_best_move, 3},
+};
+
+static bool check_one(const check_t *c)
+{
+    long cases;
+    long fails = c->run(c->arg, &cases);
+    printf("%s\t%s\t%ld\t%ld\n", c->name, fails ? "FAIL" : "ok", fails,
+           cases);
+    fflush(stdout);
+    return !fails;
+}
+
+/* Double the rounds until a run takes min_ns, then keep the best of repeat
+ * runs of that many rounds.
+ */
+static void bench_one(const bench_t *b, int64_t min_ns, int repeat)
+{
+    long rounds = 1, ops;
+    int64_t ns = b->run(b->arg, rounds, &ops);
+    while (ns < min_ns && ops) {
+        rounds *= 2;
+        ns = b->run(b->arg, rounds, &ops);
+    }
+    if (!ops) {
+        printf("%s\t-\t0\n", b->name);
+        return;
+    }
+
+    for (int i = 1; i < repeat; i++) {
+        int64_t again = b->run(b->arg, rounds, &ops);
+        if (again < ns)
+            ns = again;
+    }
+    printf("%s\t%.1f\t%ld\n", b->name, (double) ns / ops, ops);
+    fflush(stdout);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --boards FILE     board corpus (default data/boards)\n"
+            "  --filter STR      only run benchmarks whose name contains STR\n"
+            "  --min-ms N        time each benchmark for at least N ms "
+            "(default 100)\n"
+            "  --repeat N        keep the best of N runs (default 3)\n"
+            "  --record N        write a corpus of N boards to stdout\n"
+            "  --seed S          seed the games of --record (default 1)\n"
+            "  --check           check the fast paths on the corpus instead\n"
+            "  --help            show this help\n",
+            prog);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option opts[] = {
+        {"boards", required_argument, NULL, 'b'},
+        {"filter", required_argument, NULL, 'f'},
+        {"min-ms", required_argument, NULL, 'm'},
+        {"repeat", required_argument, NULL, 'r'},
+        {"record", required_argument, NULL, 'R'},
+        {"seed", required_argument, NULL, 's'},
+        {"check", no_argument, NULL, 'c'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    const char *boards_file = "data/boards", *filter = NULL;
+    int min_ms = 100, repeat = 3, record = 0;
+    unsigned seed = 1;
+    bool check = false;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+        switch (opt) {
+        case 'b':
+            boards_file = optarg;
+            break;
+        case 'f':
+            filter = optarg;
+            break;
+        case 'm':
+            min_ms = atoi(optarg);
+            break;
+        case 'r':
+            repeat = atoi(optarg);
+            break;
+        case 'R':
+            record = atoi(optarg);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        case 'c':
+            check = true;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!shapes_init(NULL)) {
+        fprintf(stderr, "Failed to load shapes\n");
+        return 1;
+    }
+    weights = default_weights();
+
+    if (record > 0) {
+        boards_record(stdout, record, seed);
+        return 0;
+    }
+
+    if (!boards_load(boards_file)) {
+        fprintf(stderr, "Failed to load boards from %s\n", boards_file);
+        return 1;
+    }
+    cases_init();
+
+    if (check) {
+        bool ok = true;
+        printf("# boards %d row_bits %d eval %s\n", n_boards, GRID_ROW_BITS,
+               eval_kernel_name());
+        printf("# name\tresult\tfailures\tcases\n");
+        for (size_t i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+            if (!filter || strstr(checks[i].name, filter))
+                ok &= check_one(&checks[i]);
+        }
+        return ok ? 0 : 1;
+    }
+
+    printf("# boards %d row_bits %d eval %s stats %d\n", n_boards,
+           GRID_ROW_BITS, eval_kernel_name(), SEARCH_STATS);
+    printf("# name\tns/op\tops\n");
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        if (!filter || strstr(benches[i].name, filter))
+            bench_one(&benches[i], min_ms * 1000000LL, repeat);
+    }
+
+    free(weights);
+    free_shape();
+    return 0;
+}
@@ -4,7 +4,7 @@
 #include "nalloc.h"
 #include "tetris.h"
 
-void block_init(block_t *b, shape_t *s)
+void block_init(block_t *b, const shape_t *s)
 {
     b->rot = 0;
     b->offset.x = 0, b->offset.y = 0;
@@ -20,7 +20,7 @@ block_t *block_new(void)
 
 void block_get(block_t *b, int i, coord_t *result)
 {
-    int *rot = b->shape->rot[b->rot][i];
+    const int8_t *rot = b->shape->rot_flat[b->rot][i];
     result->x = rot[0] + b->offset.x;
     result->y = rot[1] + b->offset.y;
 }
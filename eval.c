@@ -0,0 +1,436 @@
+/*
+ * Board evaluation: six features of the relief and gaps, weighted.
+ *
+ * grid_eval reads the running sums a grid maintains, which is O(1) in the
+ * board size. eval_boards computes the same features from plain relief and
+ * gaps vectors of many boards, with int16 lanes. It has AVX2, SSE4.1, NEON
+ * and scalar kernels, one of which is picked when the program starts. All
+ * kernels only produce integer sums, and share the float arithmetic that turns
+ * them into a score, so every kernel returns exactly what grid_eval does.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define EVAL_X86 1
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define EVAL_NEON 1
+#endif
+
+#include "nalloc.h"
+#include "tetris.h"
+
+enum {
+    FEATIDX_RELIEF_MAX = 0,
+    FEATIDX_RELIEF_AVG,
+    FEATIDX_RELIEF_VAR,
+    FEATIDX_GAPS,
+    FEATIDX_OBS,
+    FEATIDX_DISCONT,
+    N_FEATIDX,
+};
+
+_Static_assert(N_FEATIDX == EVAL_N_WEIGHTS, "EVAL_N_WEIGHTS is stale");
+
+/* Override with --weights FILE, e.g. the output of tetris-train */
+static const float predefined_weights[] = {
+    [FEATIDX_RELIEF_MAX] = 0.23,  [FEATIDX_RELIEF_AVG] = -3.62,
+    [FEATIDX_RELIEF_VAR] = -0.21, [FEATIDX_GAPS] = -0.89,
+    [FEATIDX_OBS] = -0.96,        [FEATIDX_DISCONT] = -0.27,
+};
+
+static const char *const weight_names[] = {
+    [FEATIDX_RELIEF_MAX] = "relief_max", [FEATIDX_RELIEF_AVG] = "relief_avg",
+    [FEATIDX_RELIEF_VAR] = "relief_var", [FEATIDX_GAPS] = "gaps",
+    [FEATIDX_OBS] = "obs",               [FEATIDX_DISCONT] = "discont",
+};
+
+float *default_weights()
+{
+    float *w = malloc(sizeof(predefined_weights));
+    memcpy(w, predefined_weights, sizeof(predefined_weights));
+    return w;
+}
+
+const char *weight_name(int i)
+{
+    return weight_names[i];
+}
+
+/* Weights files hold "name value" lines, '#' starting a comment. Weights the
+ * file does not name keep their value in w.
+ */
+bool weights_load(const char *path, float *w)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return false;
+
+    char line[256], name[64];
+    float val;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "#")] = '\0';
+        int n = sscanf(line, "%63s %f", name, &val);
+        if (n == EOF)
+            continue; /* blank line */
+        if (n != 2) {
+            ok = false;
+            break;
+        }
+        int i = 0;
+        while (i < N_FEATIDX && strcmp(name, weight_names[i]))
+            i++;
+        if (i == N_FEATIDX)
+            ok = false;
+        else
+            w[i] = val;
+    }
+    fclose(f);
+    return ok;
+}
+
+void weights_write(FILE *f, const float *w)
+{
+    for (int i = 0; i < N_FEATIDX; i++)
+        fprintf(f, "%s %.6g\n", weight_names[i], w[i]);
+}
+
+/* Score of a board from the sums of its relief (s1), squared relief (s2),
+ * gaps, its highest relief and the number of columns whose relief differs
+ * from their left one (the one left of column 0 being -1).
+ */
+static inline float eval_score(int s1,
+                               int s2,
+                               int gaps,
+                               int relief_max,
+                               int steps,
+                               int width,
+                               const float *weights)
+{
+    float raws[N_FEATIDX];
+
+    /* avg is the mean of relief + 1, while var measures relief against avg:
+     * var = sum((avg - relief)^2) = (W * S2 - 2 * A * S1 + A^2) / W
+     * with S1 and S2 the sums of relief and relief^2, and A = S1 + W.
+     */
+    int64_t a = (int64_t) s1 + width;
+    float avg = (float) a / width;
+    float var = (float) (width * (int64_t) s2 - 2 * a * s1 + a * a) / width;
+
+    raws[FEATIDX_RELIEF_MAX] = relief_max > 0 ? relief_max : 0;
+    raws[FEATIDX_RELIEF_AVG] = avg;
+    raws[FEATIDX_RELIEF_VAR] = var;
+    raws[FEATIDX_DISCONT] = steps - 1;
+    raws[FEATIDX_GAPS] = gaps;
+    raws[FEATIDX_OBS] = s1 - gaps;
+
+    float val = 0;
+    for (int i = 0; i < N_FEATIDX; i++)
+        val += raws[i] * weights[i];
+    return val;
+}
+
+float grid_eval(const grid_t *g, const float *weights)
+{
+    return eval_score(g->relief_sum, g->relief_sq_sum, g->gaps_sum,
+                      g->relief_max, g->n_relief_steps, g->width, weights);
+}
+
+typedef void (*eval_fn_t)(const int16_t *relief,
+                          const int16_t *gaps,
+                          int width,
+                          int stride,
+                          size_t n,
+                          const float *w,
+                          float *out);
+
+static void eval_scalar(const int16_t *relief,
+                        const int16_t *gaps,
+                        int width,
+                        int stride,
+                        size_t n,
+                        const float *w,
+                        float *out)
+{
+    for (size_t i = 0; i < n; i++, relief += stride, gaps += stride) {
+        int s1 = 0, s2 = 0, g = 0, mx = -1, steps = 0, last = -1;
+        for (int c = 0; c < width; c++) {
+            int h = relief[c];
+            s1 += h;
+            s2 += h * h;
+            g += gaps[c];
+            mx = h > mx ? h : mx;
+            steps += h != last;
+            last = h;
+        }
+        out[i] = eval_score(s1, s2, g, mx, steps, width, w);
+    }
+}
+
+#ifdef EVAL_X86
+/* Lanes c0 .. c0 + 7 that lie inside the board */
+__attribute__((target("sse4.1"))) static inline __m128i lanes_in(int c0,
+                                                                 int width)
+{
+    __m128i idx = _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7);
+    idx = _mm_add_epi16(idx, _mm_set1_epi16(c0));
+    return _mm_cmplt_epi16(idx, _mm_set1_epi16(width));
+}
+
+/* Finish a board from per-lane sums: s1, s2, gaps and steps as int32 lanes,
+ * the relief maximum as int16 lanes.
+ */
+__attribute__((target("sse4.1"))) static inline float eval_reduce(__m128i s1,
+                                                                  __m128i s2,
+                                                                  __m128i g,
+                                                                  __m128i st,
+                                                                  __m128i mx,
+                                                                  int width,
+                                                                  const float *w)
+{
+    /* One transposing reduction for all four sums */
+    __m128i sums = _mm_hadd_epi32(_mm_hadd_epi32(s1, s2), _mm_hadd_epi32(g, st));
+
+    mx = _mm_max_epi16(mx, _mm_shuffle_epi32(mx, _MM_SHUFFLE(1, 0, 3, 2)));
+    mx = _mm_max_epi16(mx, _mm_shuffle_epi32(mx, _MM_SHUFFLE(2, 3, 0, 1)));
+    mx = _mm_max_epi16(mx, _mm_srli_epi32(mx, 16));
+
+    return eval_score(_mm_extract_epi32(sums, 0), _mm_extract_epi32(sums, 1),
+                      _mm_extract_epi32(sums, 2), (int16_t) _mm_cvtsi128_si32(mx),
+                      _mm_extract_epi32(sums, 3), width, w);
+}
+
+__attribute__((target("sse4.1"))) static void eval_sse41(const int16_t *relief,
+                                                         const int16_t *gaps,
+                                                         int width,
+                                                         int stride,
+                                                         size_t n,
+                                                         const float *w,
+                                                         float *out)
+{
+    int n_chunks = (width + 7) / 8;
+    __m128i in[GRID_ROW_BITS / 8];
+    for (int k = 0; k < n_chunks; k++)
+        in[k] = lanes_in(8 * k, width);
+    const __m128i ones = _mm_set1_epi16(1), none = _mm_set1_epi16(-1);
+
+    for (size_t i = 0; i < n; i++, relief += stride, gaps += stride) {
+        __m128i s1 = _mm_setzero_si128(), s2 = s1, g = s1, st = s1;
+        __m128i mx = none, prev = none;
+        for (int k = 0; k < n_chunks; k++) {
+            __m128i r = _mm_loadu_si128((const __m128i *) (relief + 8 * k));
+            __m128i gp = _mm_loadu_si128((const __m128i *) (gaps + 8 * k));
+
+            s1 = _mm_add_epi32(s1, _mm_madd_epi16(r, ones));
+            s2 = _mm_add_epi32(s2, _mm_madd_epi16(r, r));
+            g = _mm_add_epi32(g, _mm_madd_epi16(gp, ones));
+            mx = _mm_max_epi16(mx, r);
+
+            /* Relief of the column left to each lane. A differing lane is
+             * -1 in the mask, and counts as (-1) * (-1) in the sums.
+             */
+            __m128i left = _mm_alignr_epi8(r, prev, 14);
+            __m128i same = _mm_cmpeq_epi16(r, left);
+            st = _mm_add_epi32(
+                st, _mm_madd_epi16(_mm_andnot_si128(same, in[k]), none));
+            prev = r;
+        }
+        out[i] = eval_reduce(s1, s2, g, st, mx, width, w);
+    }
+}
+
+__attribute__((target("avx2"))) static void eval_avx2(const int16_t *relief,
+                                                      const int16_t *gaps,
+                                                      int width,
+                                                      int stride,
+                                                      size_t n,
+                                                      const float *w,
+                                                      float *out)
+{
+    int n_chunks = (width + 15) / 16;
+    __m256i in[GRID_ROW_BITS / 16];
+    for (int k = 0; k < n_chunks; k++) {
+        __m256i idx = _mm256_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11,
+                                        12, 13, 14, 15);
+        idx = _mm256_add_epi16(idx, _mm256_set1_epi16(16 * k));
+        in[k] = _mm256_cmpgt_epi16(_mm256_set1_epi16(width), idx);
+    }
+    const __m256i ones = _mm256_set1_epi16(1), none = _mm256_set1_epi16(-1);
+
+    for (size_t i = 0; i < n; i++, relief += stride, gaps += stride) {
+        __m256i s1 = _mm256_setzero_si256(), s2 = s1, g = s1, st = s1;
+        __m256i mx = none, prev = none;
+        for (int k = 0; k < n_chunks; k++) {
+            __m256i r = _mm256_loadu_si256((const __m256i *) (relief + 16 * k));
+            __m256i gp = _mm256_loadu_si256((const __m256i *) (gaps + 16 * k));
+
+            s1 = _mm256_add_epi32(s1, _mm256_madd_epi16(r, ones));
+            s2 = _mm256_add_epi32(s2, _mm256_madd_epi16(r, r));
+            g = _mm256_add_epi32(g, _mm256_madd_epi16(gp, ones));
+            mx = _mm256_max_epi16(mx, r);
+
+            /* alignr works within 128-bit lanes: feed it the lane below */
+            __m256i below = _mm256_permute2x128_si256(prev, r, 0x21);
+            __m256i left = _mm256_alignr_epi8(r, below, 14);
+            __m256i same = _mm256_cmpeq_epi16(r, left);
+            st = _mm256_add_epi32(
+                st, _mm256_madd_epi16(_mm256_andnot_si256(same, in[k]), none));
+            prev = r;
+        }
+
+#define FOLD(v)                                    \
+    _mm_add_epi32(_mm256_castsi256_si128(v), \
+                  _mm256_extracti128_si256(v, 1))
+        __m128i mx128 = _mm_max_epi16(_mm256_castsi256_si128(mx),
+                                      _mm256_extracti128_si256(mx, 1));
+        out[i] = eval_reduce(FOLD(s1), FOLD(s2), FOLD(g), FOLD(st), mx128,
+                             width, w);
+#undef FOLD
+    }
+}
+#endif
+
+#ifdef EVAL_NEON
+static void eval_neon(const int16_t *relief,
+                      const int16_t *gaps,
+                      int width,
+                      int stride,
+                      size_t n,
+                      const float *w,
+                      float *out)
+{
+    static const int16_t lane_idx[8] = {0, 1, 2, 3, 4, 5, 6, 7};
+    int n_chunks = (width + 7) / 8;
+    uint16x8_t in[GRID_ROW_BITS / 8];
+    for (int k = 0; k < n_chunks; k++) {
+        int16x8_t idx = vaddq_s16(vld1q_s16(lane_idx), vdupq_n_s16(8 * k));
+        in[k] = vcltq_s16(idx, vdupq_n_s16(width));
+    }
+
+    for (size_t i = 0; i < n; i++, relief += stride, gaps += stride) {
+        int32x4_t s1 = vdupq_n_s32(0), s2 = s1, g = s1;
+        uint16x8_t st = vdupq_n_u16(0);
+        int16x8_t mx = vdupq_n_s16(-1), prev = mx;
+        for (int k = 0; k < n_chunks; k++) {
+            int16x8_t r = vld1q_s16(relief + 8 * k);
+            int16x8_t gp = vld1q_s16(gaps + 8 * k);
+
+            s1 = vpadalq_s16(s1, r);
+            s2 = vmlal_s16(s2, vget_low_s16(r), vget_low_s16(r));
+            s2 = vmlal_high_s16(s2, r, r);
+            g = vpadalq_s16(g, gp);
+            mx = vmaxq_s16(mx, r);
+
+            int16x8_t left = vextq_s16(prev, r, 7);
+            uint16x8_t diff = vmvnq_u16(vceqq_s16(r, left));
+            st = vsubq_u16(st, vandq_u16(diff, in[k]));
+            prev = r;
+        }
+        out[i] = eval_score(vaddvq_s32(s1), vaddvq_s32(s2), vaddvq_s32(g),
+                            vmaxvq_s16(mx), vaddvq_u16(st), width, w);
+    }
+}
+#endif
+
+static const struct {
+    const char *name;
+    eval_fn_t fn;
+} kernels[] = {
+#ifdef EVAL_X86
+    {"avx2", eval_avx2},
+    {"sse4.1", eval_sse41},
+#endif
+#ifdef EVAL_NEON
+    {"neon", eval_neon},
+#endif
+    {"scalar", eval_scalar},
+};
+
+static int kernel_supported(int k)
+{
+#ifdef EVAL_X86
+    if (kernels[k].fn == eval_avx2)
+        return __builtin_cpu_supports("avx2");
+    if (kernels[k].fn == eval_sse41)
+        return __builtin_cpu_supports("sse4.1");
+#endif
+    (void) k;
+    return 1;
+}
+
+static int kernel = -1;
+
+/* Pick the first kernel the CPU runs, before any thread can search */
+__attribute__((constructor)) static void eval_select(void)
+{
+#ifdef EVAL_X86
+    __builtin_cpu_init();
+#endif
+    for (kernel = 0; !kernel_supported(kernel); kernel++)
+        ;
+}
+
+const char *eval_kernel_name(void)
+{
+    return kernels[kernel].name;
+}
+
+bool eval_set_kernel(const char *name)
+{
+    for (int k = 0; k < (int) (sizeof(kernels) / sizeof(kernels[0])); k++) {
+        if (!strcmp(kernels[k].name, name) && kernel_supported(k)) {
+            kernel = k;
+            return true;
+        }
+    }
+    return false;
+}
+
+void eval_boards(const int16_t *relief,
+                 const int16_t *gaps,
+                 int width,
+                 int stride,
+                 size_t n,
+                 const float *w,
+                 float *out)
+{
+    kernels[kernel].fn(relief, gaps, width, stride, n, w, out);
+}
+
+eval_batch_t *eval_batch_new(int width, size_t cap, void *parent)
+{
+    eval_batch_t *b = ncalloc(1, sizeof(*b), parent);
+    b->width = width;
+    b->stride = EVAL_STRIDE(width);
+    b->cap = cap;
+    b->relief = ncalloc(cap * b->stride, sizeof(*b->relief), b);
+    b->gaps = ncalloc(cap * b->stride, sizeof(*b->gaps), b);
+    return b;
+}
+
+/* Append a snapshot of g, and return its index */
+size_t eval_batch_push(eval_batch_t *b, const grid_t *g)
+{
+    assert(b->n < b->cap);
+    int16_t *relief = b->relief + b->n * b->stride;
+    int16_t *gaps = b->gaps + b->n * b->stride;
+    for (int c = 0; c < b->width; c++) {
+        relief[c] = g->relief[c];
+        gaps[c] = g->gaps[c];
+    }
+    return b->n++;
+}
+
+void grid_eval_batch(const float *w,
+                     const eval_batch_t *b,
+                     size_t n,
+                     float *out)
+{
+    eval_boards(b->relief, b->gaps, b->width, b->stride, n, w, out);
+}
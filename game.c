@@ -1,3 +1,4 @@
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
@@ -11,38 +12,65 @@
 
 typedef enum { MOVE_LEFT, MOVE_RIGHT, DROP, ROTCW, ROTCCW, NONE } ui_move_t;
 
-static ui_move_t move_next(grid_t *g, block_t *b, shape_stream_t *ss, float *w)
+static ui_move_t move_next(search_ctx_t *ctx,
+                           ponder_t *ponder,
+                           grid_t *g,
+                           block_t *b,
+                           shape_stream_t *ss,
+                           float *w,
+                           float *score)
 {
-    static move_t *move = NULL;
-    if (!move) {
+    static move_t move;
+    static bool planned = false;
+    if (!planned) {
         /* New block. just display it. */
-        move = best_move(g, b, ss, w);
+        /* A pondered move comes without its score */
+        *score = NAN;
+        if (!ponder || !ponder_finish(ponder, g, &move)) {
+            move_t *m = best_move_ctx(ctx, g, ss, w);
+            if (!m)
+                return NONE;
+            move = *m;
+            *score = search_ctx_value(ctx);
+        }
+        planned = true;
+
+        /* Think about the next block while this one moves */
+        if (ponder)
+            ponder_start(ponder, g, &move, ss);
         return NONE;
     }
 
     /* Make moves one at a time. rotations first */
-    if (b->rot != move->rot) {
-        int inc = (move->rot - b->rot + 4) % 4;
+    if (b->rot != move.rot) {
+        int inc = (move.rot - b->rot + 4) % 4;
         return inc < 3 ? ROTCW : ROTCCW;
     }
 
-    if (b->offset.x != move->col)
-        return move->col > b->offset.x ? MOVE_RIGHT : MOVE_LEFT;
+    if (b->offset.x != move.col)
+        return move.col > b->offset.x ? MOVE_RIGHT : MOVE_LEFT;
 
     /* No further action. just drop */
-    move = NULL;
+    planned = false;
     return DROP;
 }
 
-void auto_play(float *w)
+void auto_play(float *w, const search_opts_t *opts, trace_t *rec)
 {
-    grid_t *g = grid_new(GRID_HEIGHT, GRID_WIDTH);
+    grid_t *g = grid_new(opts->height ? opts->height : GRID_HEIGHT,
+                         opts->width ? opts->width : GRID_WIDTH);
     block_t *b = block_new();
 
     tui_setup(g);
+    trace_game(rec);
 
     bool dropped = true;
-    shape_stream_t *ss = shape_stream_new();
+    float score = NAN;
+    shape_stream_t *ss = shape_stream_new(opts->preview, opts->seed, opts->bag);
+    search_ctx_t *ctx = search_ctx_new(g->height, g->width, ss->max_len, opts);
+    ponder_t *ponder = opts->ponder ? ponder_new(g->height, g->width,
+                                                 ss->max_len, opts, w)
+                                    : NULL;
 
     while (1) {
         switch (tui_scankey()) {
@@ -59,6 +87,12 @@ void auto_play(float *w)
             break;
         }
 
+        if (stats_requested()) {
+            search_stats_t st = {0};
+            search_ctx_stats(ctx, &st);
+            search_stats_print(stderr, &st);
+        }
+
         if (dropped) {
             /* Generate a new block */
             shape_stream_pop(ss);
@@ -73,7 +107,7 @@ void auto_play(float *w)
             usleep(0.3 * SECOND);
             dropped = false;
         } else {
-            ui_move_t move = move_next(g, b, ss, w);
+            ui_move_t move = move_next(ctx, ponder, g, b, ss, w, &score);
 
             /* Simulate "wait! computer is thinking" */
             usleep(0.5 * SECOND);
@@ -105,6 +139,8 @@ void auto_play(float *w)
                 grid_block_drop(g, b);
                 grid_block_add(g, b);
                 cleared = grid_clear_lines(g);
+                trace_piece(rec, g, b->shape, b->rot, b->offset.x, cleared,
+                            score);
             }
             if (cleared) {
                 /* Have to repaint the whole grid */
@@ -121,6 +157,15 @@ void auto_play(float *w)
     sleep(3);
 cleanup:
     tui_quit();
+
+    search_stats_t st = {0};
+    search_ctx_stats(ctx, &st);
+    if (ponder)
+        ponder_stats(ponder, &st);
+    search_stats_print(stdout, &st);
+
+    ponder_free(ponder);
+    search_ctx_free(ctx);
     nfree(ss);
     nfree(g);
     nfree(b);
@@ -0,0 +1,104 @@
+/* Emit a shape set as the static const table shape.c embeds with
+ * BUILTIN_SHAPES. Built and run by the Makefile, with the same CFLAGS as the
+ * program, so that row_t and the placement tables match.
+ */
+#include <stdio.h>
+
+#include "tetris.h"
+
+static void print_cells(const int8_t (*cells)[2], int n)
+{
+    printf("{");
+    for (int i = 0; i < n; i++)
+        printf("%s{%d, %d}", i ? ", " : "", cells[i][0], cells[i][1]);
+    printf("}");
+}
+
+static void print_place(const placement_t *p)
+{
+    printf("    {{");
+    for (int i = 0; i < MAX_BLOCK_LEN; i++)
+        printf("%s0x%llx", i ? ", " : "", (unsigned long long) p->mask[i]);
+    printf("}, ");
+    print_cells(p->cells, MAX_BLOCK_LEN);
+    printf(", ");
+    print_cells(p->crust, MAX_BLOCK_LEN);
+    printf(", %d, %d, %d, %d},\n", p->n_crust, p->rot, p->col, p->height);
+}
+
+static void print_shape(const shape_t *s, int idx)
+{
+    printf("    {\n        .n_rot = %d,\n        .rot_wh = {", s->n_rot);
+    for (int r = 0; r < 4; r++)
+        printf("%s{%d, %d}", r ? ", " : "", s->rot_wh[r].x, s->rot_wh[r].y);
+    printf("},\n        .crust_len = {");
+    for (int r = 0; r < 4; r++) {
+        printf("%s{", r ? ", " : "");
+        for (int d = 0; d < 4; d++)
+            printf("%s%d", d ? ", " : "", s->crust_len[r][d]);
+        printf("}");
+    }
+    printf("},\n        .crust_flat = {\n");
+    for (int r = 0; r < 4; r++) {
+        printf("            {");
+        for (int d = 0; d < 4; d++) {
+            printf("%s", d ? ", " : "");
+            print_cells(s->crust_flat[r][d], MAX_BLOCK_LEN);
+        }
+        printf("},\n");
+    }
+    printf("        },\n        .max_dim_len = %d,\n", s->max_dim_len);
+    printf("        .rot_flat = {");
+    for (int r = 0; r < 4; r++) {
+        printf("%s", r ? ", " : "");
+        print_cells(s->rot_flat[r], MAX_BLOCK_LEN);
+    }
+    printf("},\n        .rot_mask = {");
+    for (int r = 0; r < 4; r++) {
+        printf("%s{", r ? ", " : "");
+        for (int i = 0; i < MAX_BLOCK_LEN; i++)
+            printf("%s0x%llx", i ? ", " : "",
+                   (unsigned long long) s->rot_mask[r][i]);
+        printf("}");
+    }
+    printf("},\n        .place = {");
+    for (int r = 0; r < s->n_rot; r++)
+        printf("%sbuiltin_place_%d + %d", r ? ", " : "", idx,
+               (int) (s->place[r] - s->place[0]));
+    printf("},\n    },\n");
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2 || !shapes_init(argv[1])) {
+        fprintf(stderr, "Usage: %s SHAPES_FILE\n", argv[0]);
+        return 1;
+    }
+
+    printf("/* Generated by gen-shapes from %s, do not edit */\n\n", argv[1]);
+    printf("#if GRID_ROW_BITS != %d\n", GRID_ROW_BITS);
+    printf("#error \"shapes.inc was generated for GRID_ROW_BITS=%d\"\n",
+           GRID_ROW_BITS);
+    printf("#endif\n");
+
+    int n = shapes_count();
+    for (int i = 0; i < n; i++) {
+        const shape_t *s = shape_get(i);
+        const placement_t *p = s->place[0];
+        const placement_t *end = s->place[s->n_rot - 1] + GRID_ROW_BITS -
+                                 s->rot_wh[s->n_rot - 1].x + 1;
+
+        printf("\nstatic const placement_t builtin_place_%d[] = {\n", i);
+        for (; p < end; p++)
+            print_place(p);
+        printf("};\n");
+    }
+
+    printf("\nstatic const shape_t builtin_shapes[] = {\n");
+    for (int i = 0; i < n; i++)
+        print_shape(shape_get(i), i);
+    printf("};\n");
+
+    free_shape();
+    return 0;
+}
@@ -1,3 +1,4 @@
+#include <assert.h>
 #include <limits.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -6,74 +7,239 @@
 #include "nalloc.h"
 #include "tetris.h"
 
-static void grid_reset(grid_t *g)
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
+
+/* Zobrist key of cell (r, c). Keys are derived with splitmix64 rather than
+ * drawn into a table, so that they exist for any board size.
+ */
+static inline uint64_t zobrist_key(int r, int c)
+{
+    uint64_t z = ((uint64_t) r << 8 | c) * 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static inline uint64_t zobrist_row(int r, row_t bits)
+{
+    uint64_t h = 0;
+    for (; bits; bits &= bits - 1)
+        h ^= zobrist_key(r, __builtin_ctzll(bits));
+    return h;
+}
+
+/* Update relief[c] and the features depending on it */
+static inline void grid_relief_set(grid_t *g, int c, int h)
+{
+    int old = g->relief[c];
+    int left = c ? g->relief[c - 1] : -1;
+    g->n_relief_steps += (h != left) - (old != left);
+    if (c + 1 < g->width) {
+        int right = g->relief[c + 1];
+        g->n_relief_steps += (h != right) - (old != right);
+    }
+
+    g->relief_sum += h - old;
+    g->relief_sq_sum += h * h - old * old;
+    g->relief_cnt[old + 1]--;
+    g->relief_cnt[h + 1]++;
+    if (h > g->relief_max)
+        g->relief_max = h;
+    while (g->relief_max >= 0 && !g->relief_cnt[g->relief_max + 1])
+        g->relief_max--;
+
+    g->relief[c] = h;
+}
+
+static inline int col_top(col_t col)
 {
-    for (int r = 0; r < g->height; r++)
-        memset(g->rows[r], 0, GRID_WIDTH * sizeof(*g->rows[r]));
+    return col ? 63 - __builtin_clzll(col) : -1;
+}
+
+/* Take the rows set in del out of col, moving the rows above them down */
+static inline col_t col_compact(col_t col, col_t del)
+{
+#ifdef __BMI2__
+    return _pext_u64(col, ~del);
+#else
+    /* Highest first, so the positions left to remove stay put */
+    while (del) {
+        int r = col_top(del);
+        col_t low = ((col_t) 1 << r) - 1;
+        col = (col & low) | ((col >> 1) & ~low);
+        del &= low;
+    }
+    return col;
+#endif
+}
+
+/* Inverse of col_compact: open up empty rows at the positions set in ins */
+static inline col_t col_expand(col_t col, col_t ins)
+{
+#ifdef __BMI2__
+    return _pdep_u64(col, ~ins);
+#else
+    /* Lowest first, as positions are those of the expanded column */
+    for (; ins; ins &= ins - 1) {
+        col_t hi = ~(col_t) 0 << __builtin_ctzll(ins);
+        col = (col & ~hi) | ((col & hi) << 1);
+    }
+    return col;
+#endif
+}
+
+/* The column passes come in copies specialized for the common board
+ * widths, where the width is a constant the compiler unrolls the loop for,
+ * and a generic one for any other width.
+ */
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+enum { COL_KEEP, COL_COMPACT, COL_EXPAND };
+
+/* Put every column through op with rows, then recompute relief and gaps
+ * from the occupancy, along with the evaluation features.
+ */
+static ALWAYS_INLINE void cols_update(grid_t *g,
+                                      int op,
+                                      col_t rows,
+                                      const int width)
+{
+    int relief_sum = 0, relief_sq_sum = 0, gaps_sum = 0;
+    int steps = 0, relief_max = -1, last = -1;
+    memset(g->relief_cnt, 0, (g->height + 1) * sizeof(*g->relief_cnt));
+
+    for (int c = 0; c < width; c++) {
+        col_t col = g->cols[c];
+        if (op == COL_COMPACT)
+            col = col_compact(col, rows);
+        else if (op == COL_EXPAND)
+            col = col_expand(col, rows) | rows;
+        g->cols[c] = col;
+
+        int h = col_top(col);
+        int gaps = h + 1 - __builtin_popcountll(col);
+        g->relief[c] = h;
+        g->gaps[c] = gaps;
+        relief_sum += h;
+        relief_sq_sum += h * h;
+        g->relief_cnt[h + 1]++;
+        relief_max = h > relief_max ? h : relief_max;
+        steps += h != last;
+        last = h;
+        gaps_sum += gaps;
+    }
+
+    g->relief_sum = relief_sum;
+    g->relief_sq_sum = relief_sq_sum;
+    g->gaps_sum = gaps_sum;
+    g->n_relief_steps = steps;
+    g->relief_max = relief_max;
+}
 
-    for (int c = 0; c < GRID_WIDTH; c++) {
-        g->relief[c] = -1;
-        g->gaps[c] = 0;
-        g->stack_cnt[c] = 0;
+static ALWAYS_INLINE void grid_cols_update(grid_t *g, int op, col_t rows)
+{
+    switch (g->width) {
+    case 10:
+        cols_update(g, op, rows, 10);
+        break;
+    case 14:
+        cols_update(g, op, rows, 14);
+        break;
+    case 16:
+        cols_update(g, op, rows, 16);
+        break;
+#if GRID_ROW_BITS >= 32
+    case 32:
+        cols_update(g, op, rows, 32);
+        break;
+#endif
+#if GRID_ROW_BITS >= 64
+    case 64:
+        cols_update(g, op, rows, 64);
+        break;
+#endif
+    default:
+        cols_update(g, op, rows, g->width);
+        break;
     }
+}
+
+static void grid_reset(grid_t *g)
+{
+    memset(g->rows, 0, g->height * sizeof(*g->rows));
+    memset(g->cols, 0, g->width * sizeof(*g->cols));
 
-    memset(g->n_row_fill, 0, g->height * sizeof(*g->n_row_fill));
     g->n_total_cleared = 0;
     g->n_last_cleared = 0;
     g->n_full_rows = 0;
+    g->hash = 0;
+    grid_cols_update(g, COL_KEEP, 0);
 }
 
-grid_t *grid_new(int height, int width)
+/* A grid lives in one contiguous block: the grid_t header followed by its
+ * arrays, widest elements first so that every array stays aligned.
+ */
+#define ALIGN8(n) (((n) + 7) & ~(size_t) 7)
+
+static size_t grid_layout(grid_t *g)
 {
-    grid_t *g = nalloc(sizeof(grid_t), NULL);
-    g->width = width, g->height = height;
-    g->rows = ncalloc(height, sizeof(*g->rows), g);
-    g->stacks = ncalloc(width, sizeof(*g->stacks), g);
-    g->relief = ncalloc(width, sizeof(*g->relief), g);
-    g->gaps = ncalloc(width, sizeof(*g->gaps), g);
-    g->stack_cnt = ncalloc(width, sizeof(*g->stack_cnt), g);
-    g->n_row_fill = ncalloc(height, sizeof(*g->n_row_fill), g);
-    g->full_rows = ncalloc(height, sizeof(*g->full_rows), g);
-
-    for (int r = 0; r < g->height; r++)
-        g->rows[r] = ncalloc(GRID_WIDTH, sizeof(*g->rows), g);
-    for (int c = 0; c < GRID_WIDTH; c++)
-        g->stacks[c] = ncalloc(g->height, sizeof(*g->stacks), g);
+    int h = g->height, w = g->width;
+    char *p = (char *) g + ALIGN8(sizeof(*g));
+
+    g->cols = (col_t *) p;
+    p += w * sizeof(*g->cols);
+    g->rows = (row_t *) p;
+    p += ALIGN8(h * sizeof(*g->rows));
+    g->relief = (int *) p;
+    p += w * sizeof(*g->relief);
+    g->gaps = (int *) p;
+    p += w * sizeof(*g->gaps);
+    g->full_rows = (int *) p;
+    p += h * sizeof(*g->full_rows);
+    g->relief_cnt = (int *) p;
+    p += (h + 1) * sizeof(*g->relief_cnt);
+
+    return ALIGN8(p - (char *) g);
+}
 
-    grid_reset(g);
-    return g;
+size_t grid_size(int height, int width)
+{
+    grid_t g = {.height = height, .width = width};
+    return grid_layout(&g);
 }
 
-void grid_cpy(grid_t *dst, const grid_t *src)
+grid_t *grid_init(void *mem, int height, int width)
 {
-    dst->n_full_rows = src->n_full_rows;
-    dst->width = src->width, dst->height = src->height;
-    dst->n_last_cleared = src->n_last_cleared;
-    dst->n_total_cleared = src->n_total_cleared;
+    if (width > GRID_ROW_BITS || height > GRID_MAX_HEIGHT)
+        return NULL;
 
-    for (int i = 0; i < src->height; i++)
-        memcpy(dst->rows[i], src->rows[i], src->width * sizeof(*src->rows[i]));
+    grid_t *g = mem;
+    g->width = width, g->height = height;
+    g->size = grid_layout(g);
+    g->full_mask = (row_t) ~(row_t) 0 >> (GRID_ROW_BITS - width);
+    grid_reset(g);
+    return g;
+}
 
-    for (int i = 0; i < src->width; i++)
-        memcpy(dst->stacks[i], src->stacks[i],
-               src->height * sizeof(*src->stacks[i]));
+grid_t *grid_new(int height, int width)
+{
+    if (width > GRID_ROW_BITS || height > GRID_MAX_HEIGHT)
+        return NULL;
 
-    memcpy(dst->full_rows, src->full_rows,
-           src->height * sizeof(*src->full_rows));
-    memcpy(dst->n_row_fill, src->n_row_fill,
-           src->height * sizeof(*src->n_row_fill));
-    memcpy(dst->relief, src->relief, src->width * sizeof(*src->relief));
-    memcpy(dst->stack_cnt, src->stack_cnt,
-           src->width * sizeof(*src->stack_cnt));
-    memcpy(dst->gaps, src->gaps, src->width * sizeof(*src->gaps));
+    return grid_init(nalloc(grid_size(height, width), NULL), height, width);
 }
 
-static inline int grid_height_at_start_at(grid_t *g, int x, int start_at)
+void grid_cpy(grid_t *dst, const grid_t *src)
 {
-    int y;
-    for (y = start_at; y >= 0 && !g->rows[y][x]; y--)
-        ;
-    return y;
+    /* Both grids have the same layout. Copy the whole block, then point the
+     * arrays back into dst.
+     */
+    SPAN_BEGIN("grid_cpy");
+    memcpy(dst, src, src->size);
+    grid_layout(dst);
+    SPAN_END();
 }
 
 static inline void grid_remove_full_row(grid_t *g, int r)
@@ -90,106 +256,93 @@ static inline void grid_remove_full_row(grid_t *g, int r)
 
 static inline void grid_cell_add(grid_t *g, int r, int c)
 {
-    g->rows[r][c] = true;
-    g->n_row_fill[r] += 1;
-    if (g->n_row_fill[r] == GRID_WIDTH)
+    g->rows[r] |= (row_t) 1 << c;
+    g->hash ^= zobrist_key(r, c);
+    if (g->rows[r] == g->full_mask)
         g->full_rows[g->n_full_rows++] = r;
 
+    g->cols[c] |= (col_t) 1 << r;
     int top = g->relief[c];
     if (top < r) {
-        g->relief[c] = r;
+        grid_relief_set(g, c, r);
         g->gaps[c] += r - 1 - top;
-        g->stacks[c][g->stack_cnt[c]++] = r;
+        g->gaps_sum += r - 1 - top;
     } else {
-        g->gaps[c]--;
         /* adding under the relief */
-        int idx = g->stack_cnt[c] - 1; /* insert idx */
-        for (; idx > 0 && g->stacks[c][idx - 1] > r; idx--)
-            ;
-        memmove(g->stacks[c] + idx + 1, g->stacks[c] + idx,
-                (g->stack_cnt[c] - idx) * sizeof(*g->stacks[c]));
-        g->stacks[c][idx] = r;
-        g->stack_cnt[c]++;
+        g->gaps[c]--;
+        g->gaps_sum--;
     }
 }
 
 static inline void grid_cell_remove(grid_t *g, int r, int c)
 {
-    g->rows[r][c] = false;
-    if (g->n_row_fill[r] == GRID_WIDTH) {
+    if (g->rows[r] == g->full_mask) {
         /* need to maintain g->full_rows and g->n_full_rows invariants */
         grid_remove_full_row(g, r);
     }
+    g->rows[r] &= ~((row_t) 1 << c);
+    g->hash ^= zobrist_key(r, c);
 
-    g->n_row_fill[r] -= 1;
+    g->cols[c] &= ~((col_t) 1 << r);
     int top = g->relief[c];
     if (top == r) {
-        g->stack_cnt[c]--;
-        int new_top = g->stack_cnt[c] ? g->stacks[c][g->stack_cnt[c] - 1] : -1;
-        g->relief[c] = new_top;
+        int new_top = col_top(g->cols[c]);
+        grid_relief_set(g, c, new_top);
         g->gaps[c] -= (top - 1 - new_top);
+        g->gaps_sum -= (top - 1 - new_top);
     } else {
-        g->gaps[c]++;
-
         /* removing under the relief */
-        int idx = g->stack_cnt[c] - 1; /* insert idx */
-        for (; g->stacks[c][idx] != r; idx--)
-            ;
-        memmove(g->stacks[c] + idx, g->stacks[c] + idx + 1,
-                (g->stack_cnt[c] - idx) * sizeof(*g->stacks[c]));
-        g->stack_cnt[c]--;
+        g->gaps[c]++;
+        g->gaps_sum++;
     }
 }
 
-void grid_block_add(grid_t *g, block_t *b)
+void grid_load_rows(grid_t *g, const row_t *rows, int n)
 {
-    int dc = b->offset.x, dr = b->offset.y;
-    int *rot = (int *) b->shape->rot_flat[b->rot];
+    grid_reset(g);
+    for (int r = 0; r < n && r < g->height; r++) {
+        row_t bits = rows[r] & g->full_mask;
+        g->rows[r] = bits;
+        g->hash ^= zobrist_row(r, bits);
+        if (bits == g->full_mask)
+            g->full_rows[g->n_full_rows++] = r;
+        for (; bits; bits &= bits - 1)
+            g->cols[__builtin_ctzll(bits)] |= (col_t) 1 << r;
+    }
+    grid_cols_update(g, COL_KEEP, 0);
+}
 
-    for (int i = 0; i < 2 * 4; i += 2) {
-        int c = rot[i] + dc;
-        int r = rot[i + 1] + dr;
+void grid_cell_set(grid_t *g, int r, int c)
+{
+    if (!(g->rows[r] & (row_t) 1 << c))
         grid_cell_add(g, r, c);
-    }
 }
 
-void grid_block_remove(grid_t *g, block_t *b)
+void grid_place_add(grid_t *g, const placement_t *p, int y)
 {
-    int dc = b->offset.x, dr = b->offset.y;
-    int *rot = (int *) (b->shape->rot_flat[b->rot]);
+    for (int i = 0; i < MAX_BLOCK_LEN; i++)
+        grid_cell_add(g, p->cells[i][1] + y, p->cells[i][0]);
+}
 
-    for (int i = 2 * 3; i >= 0; i -= 2) {
-        int c = rot[i] + dc;
-        int r = rot[i + 1] + dr;
-        grid_cell_remove(g, r, c);
-    }
+void grid_place_remove(grid_t *g, const placement_t *p, int y)
+{
+    for (int i = MAX_BLOCK_LEN - 1; i >= 0; i--)
+        grid_cell_remove(g, p->cells[i][1] + y, p->cells[i][0]);
 }
 
-static int max_height(const int *heights, int count)
+static inline const placement_t *block_place(const block_t *b)
 {
-    int mx = heights[0];
-    for (int i = 1; i < count; i++) {
-        int curr = heights[i];
-        mx = curr > mx ? curr : mx;
-    }
-    return mx;
+    return &b->shape->place[b->rot][b->offset.x];
 }
 
-static void sort_cleared_rows(int *full_rows, int count)
+void grid_block_add(grid_t *g, block_t *b)
 {
-    bool done = false;
-    while (!done) {
-        done = true;
-        for (int i = 1; i < count; i++) {
-            if (full_rows[i - 1] >= full_rows[i])
-                continue;
+    grid_place_add(g, block_place(b), b->offset.y);
+}
 
-            int tmp = full_rows[i - 1];
-            full_rows[i - 1] = full_rows[i];
-            full_rows[i] = tmp;
-            done = false;
-        }
-    }
+void grid_block_remove(grid_t *g, block_t *b)
+{
+    grid_place_remove(g, block_place(b), b->offset.y);
 }
 
 int grid_clear_lines(grid_t *g)
@@ -197,115 +350,124 @@ int grid_clear_lines(grid_t *g)
     if (!g->n_full_rows)
         return 0;
 
-    int expected_cleared_count = g->n_full_rows;
-    int cleared_count = 0;
-    bool *cleared[g->n_full_rows];
-    memset(cleared, false, sizeof(bool) * g->n_full_rows);
-
-    /* Smaller values means near bottom of the grid. i.e., descending order.
-     * Therefore,  we can just decrement the count to "pop" the smallest row.
-     */
-    sort_cleared_rows(g->full_rows, g->n_full_rows);
+    SPAN_BEGIN("grid_clear_lines");
+    int cleared_count = g->n_full_rows;
 
-    /* Smallest full row */
-    int y = g->full_rows[g->n_full_rows - 1];
+    /* Smallest full row. Rows below it are left untouched. */
+    int y = g->full_rows[0];
+    col_t full = 0;
+    for (int i = 0; i < g->n_full_rows; i++) {
+        if (g->full_rows[i] < y)
+            y = g->full_rows[i];
+        full |= (col_t) 1 << g->full_rows[i];
+    }
 
     /* Largest occupied (full or non-full) row */
-    int ymax = max_height(g->relief, GRID_WIDTH);
-
-    int next_non_full = y + 1;
-    while (next_non_full <= ymax) {
-        /* Copy next non-full row into y, which is either full or has already
-         * been copied into a lower y.
-         * if it is full, we zero it and save it for the end.
-         */
-
-        /* find the next non-full */
-        while (g->n_row_fill[next_non_full] == GRID_WIDTH) {
-            next_non_full++;
-            /* It should be (almost) impossible for the highest row to full.
-             * However, it is still possible, e.g., if new shape exactly fits
-             * into top row. It could happen only intentionally, so for now
-             * ignore this rare edge case.
-             */
-        }
+    int ymax = g->relief_max;
 
-        /* There is no next non full to copy into a row below */
-        if (next_non_full > ymax)
-            break;
+    /* Every row from y up moves or vanishes: rehash them around compaction */
+    for (int r = y; r <= ymax; r++)
+        g->hash ^= zobrist_row(r, g->rows[r]);
 
-        if (g->n_row_fill[y] == GRID_WIDTH) {
-            /* in this case, save row y for the end */
-            g->n_full_rows--;
-            cleared[cleared_count++] = g->rows[y];
-        }
+    /* Compact the non-full rows downwards, then zero what is left on top */
+    int y0 = y;
+    for (int r = y; r <= ymax; r++) {
+        if (g->rows[r] != g->full_mask)
+            g->rows[y++] = g->rows[r];
+    }
+    memset(g->rows + y, 0, (ymax + 1 - y) * sizeof(*g->rows));
+    for (int r = y0; r < y; r++)
+        g->hash ^= zobrist_row(r, g->rows[r]);
+
+    g->n_full_rows = 0;
+    g->n_total_cleared += cleared_count;
+    g->n_last_cleared = cleared_count;
+
+    /* Same compaction on the columns, then relief and gaps follow */
+    grid_cols_update(g, COL_COMPACT, full);
+    SPAN_END();
+
+    return g->n_last_cleared;
+}
+
+int grid_clear_lines_undoable(grid_t *g, grid_undo_t *u)
+{
+    u->n_cleared = g->n_full_rows;
+    if (!u->n_cleared)
+        return 0;
 
-        /* Reuse the row, no need to allocate new memory.
-         * copy next-non-full into y, which was previously a next-non-full
-         * and already copied, or y is full and we saved it.
-         */
-        g->rows[y] = g->rows[next_non_full];
+    /* Only the rows completed by one block can be journaled */
+    assert(u->n_cleared <= MAX_BLOCK_LEN);
+    memcpy(u->full_rows, g->full_rows, u->n_cleared * sizeof(*u->full_rows));
+    u->n_last_cleared = g->n_last_cleared;
+    u->hash = g->hash;
 
-        /* g->n_row_fill[y] must have already been used by some lower row,
-         * or it was a full row, and it is appened to cleared
-         * cleared.length + ?  = y- ymin
-         */
-        g->n_row_fill[y] = g->n_row_fill[next_non_full];
+    return grid_clear_lines(g);
+}
 
-        y++;
-        next_non_full++;
+void grid_clear_lines_undo(grid_t *g, const grid_undo_t *u)
+{
+    int k = u->n_cleared;
+    if (!k)
+        return;
+
+    col_t full = 0;
+    int qmin = u->full_rows[0], qmax = u->full_rows[0];
+    for (int i = 0; i < k; i++) {
+        full |= (col_t) 1 << u->full_rows[i];
+        qmin = u->full_rows[i] < qmin ? u->full_rows[i] : qmin;
+        qmax = u->full_rows[i] > qmax ? u->full_rows[i] : qmax;
     }
 
-    /* There might be left-over rows that were cleared.
-     * they need to be zeroed-out, and replaces into rows[y...ymax]
+    /* Reinsert the full rows, shifting the rows above them back up. The
+     * highest row was either full or moved down by k.
      */
-    g->n_total_cleared += expected_cleared_count;
-    g->n_last_cleared = expected_cleared_count;
-
-    while (cleared_count + g->n_full_rows) {
-        g->rows[y] = g->n_full_rows ? g->rows[g->full_rows[--g->n_full_rows]]
-                                    : cleared[--cleared_count];
-        g->n_row_fill[y] = 0;
-        memset(g->rows[y], 0, GRID_WIDTH * sizeof(*g->rows[y]));
-        y++;
+    int ymax = g->relief_max + k > qmax ? g->relief_max + k : qmax;
+    for (int r = ymax, src = ymax - k; r >= qmin; r--) {
+        if ((full >> r) & 1)
+            g->rows[r] = g->full_mask;
+        else
+            g->rows[r] = g->rows[src--];
     }
 
-    /* We need to update relief and stacks */
-    for (int i = 0; i < GRID_WIDTH; i++) {
-        int new_top = grid_height_at_start_at(g, i, g->relief[i]);
-        g->relief[i] = new_top;
-        int gaps = 0;
-        g->stack_cnt[i] = 0;
-        for (int ii = 0; ii <= new_top; ii++) {
-            if (g->rows[ii][i])
-                g->stacks[i][g->stack_cnt[i]++] = ii;
-            else
-                gaps++;
-        }
-        g->gaps[i] = gaps;
-    }
+    grid_cols_update(g, COL_EXPAND, full);
 
-    return g->n_last_cleared;
+    memcpy(g->full_rows, u->full_rows, k * sizeof(*g->full_rows));
+    g->n_full_rows = k;
+    g->n_total_cleared -= k;
+    g->n_last_cleared = u->n_last_cleared;
+    g->hash = u->hash;
 }
 
 static bool grid_block_in_bounds(grid_t *g, block_t *b)
 {
     return block_extreme(b, LEFT) >= 0 &&
-           block_extreme(b, RIGHT) < GRID_WIDTH && block_extreme(b, BOT) >= 0 &&
+           block_extreme(b, RIGHT) < g->width && block_extreme(b, BOT) >= 0 &&
            block_extreme(b, TOP) < g->height;
 }
 
-bool grid_block_intersects(grid_t *g, block_t *b)
+/* Test the per-row masks of a rotation, shifted to column x, against the
+ * h rows starting at rows[0].
+ */
+static inline bool rows_intersect(const row_t *rows, const row_t *mask, int h)
 {
-    for (int i = 0; i < MAX_BLOCK_LEN; i++) {
-        int *rot = b->shape->rot[b->rot][i];
-        int c = rot[0] + b->offset.x, r = rot[1] + b->offset.y;
-        if (g->rows[r][c])
+    for (int i = 0; i < h; i++) {
+        if (rows[i] & mask[i])
             return true;
     }
     return false;
 }
 
+bool grid_place_intersects(const grid_t *g, const placement_t *p, int y)
+{
+    return rows_intersect(g->rows + y, p->mask, p->height);
+}
+
+bool grid_block_intersects(grid_t *g, block_t *b)
+{
+    return grid_place_intersects(g, block_place(b), b->offset.y);
+}
+
 static inline int grid_block_valid(grid_t *g, block_t *b)
 {
     return grid_block_in_bounds(g, b) && !grid_block_intersects(g, b);
@@ -328,49 +490,72 @@ static inline int grid_block_elevate(grid_t *g, block_t *b)
 int grid_block_center_elevate(grid_t *g, block_t *b)
 {
     /*Rreturn whether block was successfully centered */
-    b->offset.x = (GRID_WIDTH - b->shape->rot_wh[b->rot].x) / 2;
+    b->offset.x = (g->width - b->shape->rot_wh[b->rot].x) / 2;
     return grid_block_elevate(g, b);
 }
 
-static int drop_amount(grid_t *g, block_t *b)
+int grid_place_drop(const grid_t *g, const placement_t *p, int y)
 {
     int min_amnt = INT_MAX;
-    int dc = b->offset.x, dr = b->offset.y;
-    int rot = b->rot;
-    int crust_len = b->shape->crust_len[rot][BOT];
-    int *crust = (int *) (b->shape->crust_flat[rot][BOT]);
-    for (int i = 0; i < crust_len; i++) {
-        int c = *crust++ + dc;
-        int r = *crust++ + dr;
-
-        int amnt = r - (g->relief[c] + 1);
+    for (int i = 0; i < p->n_crust; i++) {
+        int amnt = y + p->crust[i][1] - (g->relief[p->crust[i][0]] + 1);
         if (amnt < min_amnt)
             min_amnt = amnt;
     }
 
     if (min_amnt >= 0)
-        goto back;
+        return y - min_amnt;
 
     /* relief can not help us, as we are under the relief */
-    min_amnt = 0;
-    int max_amnt = block_extreme(b, BOT);
-    for (min_amnt = 0; min_amnt < max_amnt; min_amnt++) {
-        int next_amnt = min_amnt + 1;
-        for (int i = 0; i < b->shape->crust_len[b->rot][BOT]; i++) {
-            int *cr = b->shape->crust[b->rot][BOT][i];
-            int c = cr[0] + b->offset.x, r = cr[1] + b->offset.y;
-            if (g->rows[r - next_amnt][c])
-                goto back;
-        }
+    for (min_amnt = 0; min_amnt < y; min_amnt++) {
+        if (rows_intersect(g->rows + y - min_amnt - 1, p->mask, p->height))
+            break;
     }
+    return y - min_amnt;
+}
 
-back:
-    return min_amnt;
+/* Landing rows of the placements of s dropped from row y, as grid_place_drop
+ * gives them, for those over any of columns lo to hi - 1. Placements that
+ * would need the row by row fallback, under the relief, get -1. Return how
+ * many placements were dropped.
+ *
+ * This is the crust loop of grid_place_drop batched over the columns, with
+ * O(columns x crust) work per rotation. A sliding window maximum does not
+ * apply: the landing row is the maximum of relief[c + k] + 1 - bottom[k],
+ * and the offset bottom[k] differs at every position k of the window, so a
+ * window can not be slid by one column and reused. Crusts are only up to
+ * four cells wide anyway. The saving comes from the callers, which drop
+ * afresh only the placements over columns that changed.
+ */
+int grid_place_drops(const grid_t *g,
+                     const shape_t *s,
+                     int y,
+                     int lo,
+                     int hi,
+                     int8_t land[4][GRID_ROW_BITS])
+{
+    int n = 0;
+    for (int r = 0; r < s->n_rot; r++) {
+        int w = s->rot_wh[r].x;
+        int first = lo - w + 1 > 0 ? lo - w + 1 : 0;
+        int last = hi < g->width - w + 1 ? hi : g->width - w + 1;
+        const placement_t *p = s->place[r] + first;
+        const placement_t *end = s->place[r] + last;
+        for (; p < end; p++, n++) {
+            int top = INT_MIN;
+            for (int i = 0; i < p->n_crust; i++) {
+                int h = g->relief[p->crust[i][0]] + 1 - p->crust[i][1];
+                top = h > top ? h : top;
+            }
+            land[r][p->col] = top <= y ? top : -1;
+        }
+    }
+    return n;
 }
 
 int grid_block_drop(grid_t *g, block_t *b)
 {
-    int amount = drop_amount(g, b);
+    int amount = b->offset.y - grid_place_drop(g, block_place(b), b->offset.y);
     block_move(b, BOT, amount);
     return amount;
 }
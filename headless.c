@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nalloc.h"
+#include "tetris.h"
+
+/* Watched games show at most this many frames per second, so that the
+ * terminal never slows them down
+ */
+#define WATCH_FPS 60
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void headless_game(float *w,
+                   const search_opts_t *opts,
+                   int max_pieces,
+                   render_t *view,
+                   trace_t *rec,
+                   bool dumps,
+                   game_stats_t *st)
+{
+    grid_t *g = grid_new(opts->height ? opts->height : GRID_HEIGHT,
+                         opts->width ? opts->width : GRID_WIDTH);
+    block_t *b = block_new();
+    shape_stream_t *ss = shape_stream_new(opts->preview, opts->seed, opts->bag);
+    search_ctx_t *ctx = search_ctx_new(g->height, g->width, ss->max_len, opts);
+
+    st->n_pieces = 0;
+    double next_frame = 0;
+    trace_game(rec);
+    while (!max_pieces || st->n_pieces < max_pieces) {
+        shape_stream_pop(ss);
+        block_init(b, shape_stream_peek(ss, 0));
+        grid_block_center_elevate(g, b);
+        /* If we can not place a new block, game over */
+        if (grid_block_intersects(g, b))
+            break;
+
+        if (dumps && stats_requested()) {
+            search_stats_t now_st = {0};
+            search_ctx_stats(ctx, &now_st);
+            search_stats_print(stderr, &now_st);
+        }
+
+        move_t *move = best_move_ctx(ctx, g, ss, w);
+        if (!move)
+            break;
+
+        b->rot = move->rot;
+        b->offset.x = move->col;
+        grid_block_drop(g, b);
+        grid_block_add(g, b);
+        int cleared = grid_clear_lines(g);
+        trace_piece(rec, g, b->shape, b->rot, b->offset.x, cleared,
+                    search_ctx_value(ctx));
+        st->n_pieces++;
+
+        if (view && now() >= next_frame) {
+            render_grid(view, g);
+            render_status(view, "seed %llu  pieces %d  lines %d",
+                          (unsigned long long) opts->seed, st->n_pieces,
+                          g->n_total_cleared);
+            render_flush(view);
+            next_frame = now() + 1.0 / WATCH_FPS;
+        }
+    }
+    if (view) {
+        render_grid(view, g);
+        render_status(view, "seed %llu  pieces %d  lines %d  game over",
+                      (unsigned long long) opts->seed, st->n_pieces,
+                      g->n_total_cleared);
+        render_flush(view);
+    }
+    st->n_lines = g->n_total_cleared;
+    st->search = (search_stats_t){0};
+    search_ctx_stats(ctx, &st->search);
+
+    search_ctx_free(ctx);
+    nfree(ss);
+    nfree(g);
+    nfree(b);
+}
+
+void headless_play(float *w,
+                   const search_opts_t *opts,
+                   int n_games,
+                   int max_pieces,
+                   bool watch,
+                   trace_t *rec)
+{
+    long total_pieces = 0, total_lines = 0;
+    search_stats_t search = {0};
+    double start = now();
+
+    /* A watched run draws over the terminal, so only the totals follow it */
+    render_t *view = NULL;
+    if (watch) {
+        fflush(stdout);
+        view = render_new(opts->height ? opts->height : GRID_HEIGHT,
+                          opts->width ? opts->width : GRID_WIDTH,
+                          STDOUT_FILENO);
+    } else {
+        printf("seed %llu%s\n", (unsigned long long) opts->seed,
+               opts->bag ? " bag" : "");
+    }
+    for (int i = 0; i < n_games; i++) {
+        game_stats_t st;
+        search_opts_t game_opts = *opts;
+        game_opts.seed = opts->seed + i;
+        headless_game(w, &game_opts, max_pieces, view, rec, true, &st);
+        if (!view)
+            printf("game %d: lines %d pieces %d\n", i + 1, st.n_lines,
+                   st.n_pieces);
+        total_pieces += st.n_pieces;
+        total_lines += st.n_lines;
+        search_stats_merge(&search, &st.search);
+    }
+
+    render_free(view);
+
+    double elapsed = now() - start;
+    printf("total: games %d lines %ld pieces %ld time %.3fs pieces/sec %.1f\n",
+           n_games, total_lines, total_pieces, elapsed,
+           elapsed > 0 ? total_pieces / elapsed : 0);
+    search_stats_print(stdout, &search);
+    free_shape();
+}
@@ -0,0 +1,22 @@
+#include <errno.h>
+#include <unistd.h>
+
+#include "tetris.h"
+
+/* Write all of buf to fd, across short writes and signals. False on error
+ * or when fd takes no more.
+ */
+bool write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
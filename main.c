@@ -1,3 +1,5 @@
+#include <getopt.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
@@ -5,21 +7,313 @@
 
 #include "tetris.h"
 
-#define DATADIR "data"
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --headless        run games without a terminal, at full speed\n"
+            "  --games N         number of headless games to play (default 1)\n"
+            "  --max-pieces N    stop a headless game after N pieces\n"
+            "  --watch           draw the headless games as they are played\n"
+            "  --batch           play the headless games side by side and "
+            "summarize them\n"
+            "  --jobs N          number of batch threads (default: all "
+            "cores)\n"
+            "  --csv FILE        stream the batch results per game as CSV\n"
+            "  --json FILE       or as JSON lines\n"
+            "  --record FILE     record every piece played to a binary trace,\n"
+            "                    FILE.N for game N of a batch\n"
+            "  --replay FILE     summarize a trace, per game\n"
+            "  --seek N          with --replay, show the board before piece N\n"
+            "  --serve           answer best-move requests on stdin, see "
+            "server.c\n"
+            "  --listen PORT     answer them on a TCP port of localhost\n"
+            "  --width N         board width (default 14, at most "
+            "GRID_ROW_BITS)\n"
+            "  --height N        board height (default 20, at most 64)\n"
+            "  --seed S          seed the shape generator\n"
+            "  --bag             deal the shapes from shuffled bags of one of "
+            "each\n"
+            "  --threads N       search root placements on N threads\n"
+            "  --tt-bits N       use a transposition table of 2^N entries\n"
+            "  --preview N       number of pieces known in advance (default "
+            "3)\n"
+            "  --beam K          beam search keeping the K best boards per "
+            "piece\n"
+            "  --batch-eval      score the last piece's placements in batches\n"
+            "  --budget-us N     anytime search: deepen the search until N "
+            "microseconds\n"
+            "                    have passed, then play the deepest result\n"
+            "  --ponder          search the next piece while the current one "
+            "moves\n"
+            "  --prune N[,N...]  search only the N best placements of each "
+            "piece,\n"
+            "                    by their one-piece value, per depth\n"
+            "  --prune-margin X  and only those within X of the best\n"
+            "  --prune-check     count how often the exhaustive search "
+            "agrees\n"
+            "  --expect          average over every next piece past the "
+            "preview\n"
+            "  --expect-nodes N  with at most N such averages per move\n"
+            "  --spans FILE      write a Chrome trace of the search timeline "
+            "(make SPANS=1)\n"
+            "  --shapes FILE     load the shape set from FILE\n"
+            "  --weights FILE    load the evaluation weights from FILE\n"
+            "  --help            show this message\n",
+            prog);
+}
 
-int main()
+int main(int argc, char *argv[])
 {
-    char *shapes_file = DATADIR "/shapes";
+    static const struct option opts[] = {
+        {"headless", no_argument, NULL, 'H'},
+        {"games", required_argument, NULL, 'g'},
+        {"max-pieces", required_argument, NULL, 'p'},
+        {"watch", no_argument, NULL, 'V'},
+        {"batch", no_argument, NULL, 'A'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"csv", required_argument, NULL, 'C'},
+        {"json", required_argument, NULL, 'J'},
+        {"record", required_argument, NULL, 'R'},
+        {"replay", required_argument, NULL, 'Y'},
+        {"seek", required_argument, NULL, 'K'},
+        {"serve", no_argument, NULL, 'v'},
+        {"listen", required_argument, NULL, 'L'},
+        {"width", required_argument, NULL, 'w'},
+        {"height", required_argument, NULL, 'y'},
+        {"seed", required_argument, NULL, 's'},
+        {"bag", no_argument, NULL, 'G'},
+        {"threads", required_argument, NULL, 't'},
+        {"tt-bits", required_argument, NULL, 'T'},
+        {"preview", required_argument, NULL, 'P'},
+        {"beam", required_argument, NULL, 'B'},
+        {"batch-eval", no_argument, NULL, 'E'},
+        {"budget-us", required_argument, NULL, 'b'},
+        {"ponder", no_argument, NULL, 'o'},
+        {"prune", required_argument, NULL, 'r'},
+        {"prune-margin", required_argument, NULL, 'm'},
+        {"prune-check", no_argument, NULL, 'c'},
+        {"expect", no_argument, NULL, 'x'},
+        {"expect-nodes", required_argument, NULL, 'X'},
+        {"spans", required_argument, NULL, 'n'},
+        {"shapes", required_argument, NULL, 'S'},
+        {"weights", required_argument, NULL, 'W'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    bool headless = false, watch = false, serve = false, batch = false;
+    int n_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int port = 0;
+    int n_games = 1, max_pieces = 0;
+    search_opts_t search_opts = {
+        .n_threads = 1,
+        .seed = time(NULL) ^ getpid(),
+    };
+    const char *shapes_file = NULL, *weights_file = NULL;
+    const char *record_file = NULL, *replay_file = NULL;
+    const char *csv_file = NULL, *json_file = NULL, *spans_file = NULL;
+    long seek = -1;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+        switch (opt) {
+        case 'H':
+            headless = true;
+            break;
+        case 'g':
+            n_games = atoi(optarg);
+            break;
+        case 'p':
+            max_pieces = atoi(optarg);
+            break;
+        case 'V':
+            watch = true;
+            break;
+        case 'A':
+            batch = true;
+            break;
+        case 'j':
+            n_jobs = atoi(optarg);
+            break;
+        case 'C':
+            csv_file = optarg;
+            break;
+        case 'J':
+            json_file = optarg;
+            break;
+        case 'R':
+            record_file = optarg;
+            break;
+        case 'Y':
+            replay_file = optarg;
+            break;
+        case 'K':
+            seek = atol(optarg);
+            break;
+        case 'v':
+            serve = true;
+            break;
+        case 'L':
+            port = atoi(optarg);
+            break;
+        case 'w':
+            search_opts.width = atoi(optarg);
+            break;
+        case 'y':
+            search_opts.height = atoi(optarg);
+            break;
+        case 's':
+            search_opts.seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'G':
+            search_opts.bag = true;
+            break;
+        case 't':
+            search_opts.n_threads = atoi(optarg);
+            break;
+        case 'T':
+            search_opts.tt_bits = atoi(optarg);
+            break;
+        case 'P':
+            search_opts.preview = atoi(optarg);
+            break;
+        case 'B':
+            search_opts.beam_width = atoi(optarg);
+            break;
+        case 'E':
+            search_opts.batch_eval = true;
+            break;
+        case 'b':
+            search_opts.budget_us = atoi(optarg);
+            break;
+        case 'o':
+            search_opts.ponder = true;
+            break;
+        case 'r': {
+            /* Depths past the list take its last entry */
+            char *p = optarg;
+            int n = 0;
+            while (n < PRUNE_DEPTHS) {
+                search_opts.prune_top[n++] = strtol(p, &p, 10);
+                if (*p != ',')
+                    break;
+                p++;
+            }
+            for (int i = n; i < PRUNE_DEPTHS; i++)
+                search_opts.prune_top[i] = search_opts.prune_top[n - 1];
+            break;
+        }
+        case 'm':
+            search_opts.prune_margin = atof(optarg);
+            break;
+        case 'c':
+            search_opts.prune_check = true;
+            break;
+        case 'x':
+            search_opts.expect = true;
+            break;
+        case 'X':
+            search_opts.expect = true;
+            search_opts.expect_nodes = atoi(optarg);
+            break;
+        case 'n':
+            spans_file = optarg;
+            break;
+        case 'S':
+            shapes_file = optarg;
+            break;
+        case 'W':
+            weights_file = optarg;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (search_opts.width &&
+        (search_opts.width < 4 || search_opts.width > GRID_ROW_BITS)) {
+        fprintf(stderr, "Board width must be 4 to %d\n", GRID_ROW_BITS);
+        return 1;
+    }
+    if (search_opts.height &&
+        (search_opts.height < 4 || search_opts.height > GRID_MAX_HEIGHT)) {
+        fprintf(stderr, "Board height must be 4 to %d\n", GRID_MAX_HEIGHT);
+        return 1;
+    }
+
+    if (spans_file && !SEARCH_SPANS) {
+        fprintf(stderr, "Spans are compiled out, build with make SPANS=1\n");
+        return 1;
+    }
+    if (batch && (n_games < 1 || n_jobs < 1)) {
+        fprintf(stderr, "A batch needs at least one game and one job\n");
+        return 1;
+    }
+    if (record_file && (serve || port)) {
+        fprintf(stderr, "Requests to the best-move service are not recorded, "
+                        "drop --record\n");
+        return 1;
+    }
+
     if (!shapes_init(shapes_file)) {
-        fprintf(stderr, "Failed to open %s", shapes_file);
+        fprintf(stderr, "Failed to load shapes%s%s\n",
+                shapes_file ? " from " : "", shapes_file ? shapes_file : "");
         return 1;
     }
 
-    srand(time(NULL) ^ getpid());
+    if (replay_file)
+        return trace_replay(replay_file, seek) ? 0 : 1;
+
+    stats_signal_init();
 
     float *w = default_weights();
-    auto_play(w);
+    if (weights_file && !weights_load(weights_file, w)) {
+        fprintf(stderr, "Failed to load weights from %s\n", weights_file);
+        return 1;
+    }
+    trace_t *rec = NULL;
+    if (record_file && !batch) {
+        rec = trace_create(record_file,
+                           search_opts.height ? search_opts.height
+                                              : GRID_HEIGHT,
+                           search_opts.width ? search_opts.width : GRID_WIDTH,
+                           search_opts.seed, search_opts.bag, true);
+        if (!rec) {
+            perror(record_file);
+            return 1;
+        }
+    }
+
+    if (port) {
+        if (!serve_tcp(w, &search_opts, port)) {
+            perror("listen");
+            return 1;
+        }
+    } else if (serve)
+        serve_stdio(w, &search_opts);
+    else if (batch) {
+        if (!batch_play(w, &search_opts, n_games, max_pieces, n_jobs,
+                        csv_file, json_file, record_file))
+            return 1;
+    } else if (headless)
+        headless_play(w, &search_opts, n_games, max_pieces, watch, rec);
+    else
+        auto_play(w, &search_opts, rec);
     free(w);
 
+    if (!trace_close(rec)) {
+        fprintf(stderr, "Failed to write the trace to %s\n", record_file);
+        return 1;
+    }
+    if (spans_file && !spans_write(spans_file)) {
+        perror(spans_file);
+        return 1;
+    }
+
     return 0;
 }
@@ -1,6 +1,9 @@
 #include <float.h>
+#include <limits.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "nalloc.h"
 #include "tetris.h"
@@ -9,80 +12,479 @@
 
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 
-enum {
-    FEATIDX_RELIEF_MAX = 0,
-    FEATIDX_RELIEF_AVG,
-    FEATIDX_RELIEF_VAR,
-    FEATIDX_GAPS,
-    FEATIDX_OBS,
-    FEATIDX_DISCONT,
-    N_FEATIDX,
-};
+typedef struct {
+    const placement_t *p;
+    float value; /* one-piece value */
+    int idx;     /* in (rot, col) order */
+} prune_cand_t;
+
+typedef struct {
+    uint64_t hash;
+    float value;
+    uint32_t gen; /* of the weights it was computed with, 0 for none */
+} expect_entry_t;
+
+#define EXPECT_CACHE_BITS 15
+
+/* Landing rows of the placements of one depth's piece: base on the board of
+ * the parent node, shared by all its children, and node on the board of the
+ * current child, which only drops afresh the placements over columns lo to
+ * hi - 1, those its own placement changed.
+ */
+typedef struct {
+    int8_t base[4][GRID_ROW_BITS];
+    int8_t node[4][GRID_ROW_BITS];
+    int lo, hi;
+} drop_cache_t;
+
+struct search_ctx {
+    int max_depth; /* number of scratch levels */
+    int depth;     /* number of pieces searched by the current call */
+    grid_undo_t *undo;
+    drop_cache_t *drops; /* per depth, never used at the root */
+    move_t *best_moves;
+    const shape_t **seq; /* snapshot of the preview being searched */
+    float value;         /* of the last best move */
+
+    /* Root placements in (rot, col) order, their values, and the order in
+     * which they are searched
+     */
+    move_t *root_moves;
+    float *root_vals;
+    int *root_order;
+    int n_root;
+
+    /* Anytime search: give up on the current depth at the deadline */
+    int budget_us;
+    int64_t deadline; /* CLOCK_MONOTONIC ns, 0 for none */
+    bool aborted;
+    atomic_bool stop;
+    search_ctx_t *root; /* context whose stop requests apply, maybe self */
+
+    /* Root split: one private context and board per pool worker */
+    pool_t *pool;
+    search_ctx_t **workers;
+    const grid_t *root_grid;
+    float *root_w;
+    int root_relief_max;
+    unsigned run;
+
+    grid_t *board; /* workers only: private copy of the root grid */
+    tt_t *tt;
+    beam_t *beam;
+
+    search_stats_t st;
+
+    /* Batched leaves: snapshots of the last piece's placements */
+    eval_batch_t *batch;
+    move_t *batch_moves;
+    float *batch_vals;
 
-/* FIXME: allow future adjustments */
-static const float predefined_weights[] = {
-    [FEATIDX_RELIEF_MAX] = 0.23,  [FEATIDX_RELIEF_AVG] = -3.62,
-    [FEATIDX_RELIEF_VAR] = -0.21, [FEATIDX_GAPS] = -0.89,
-    [FEATIDX_OBS] = -0.96,        [FEATIDX_DISCONT] = -0.27,
+    /* Pruned search: the placements kept, 4 * width per depth, and the
+     * exhaustive search they are checked against
+     */
+    bool pruning;
+    int prune_top[PRUNE_DEPTHS];
+    float prune_margin;
+    prune_cand_t *cand;
+    int cand_stride;
+    search_ctx_t *exact;
+
+    /* Expectimax past the preview: chance values cached by board hash, for
+     * as long as the weights stay the same
+     */
+    bool expect;
+    int expect_nodes;    /* per move, 0 for no bound */
+    int expect_per_root; /* share of expect_nodes of every root placement */
+    int expect_left;
+    expect_entry_t *expect_cache;
+    uint32_t expect_gen;
+    float expect_w[EVAL_N_WEIGHTS];
+    grid_undo_t expect_undo;
 };
 
-float *default_weights()
+search_ctx_t *search_ctx_new(int height,
+                             int width,
+                             int max_depth,
+                             const search_opts_t *opts)
+{
+    search_ctx_t *ctx = ncalloc(1, sizeof(*ctx), NULL);
+    ctx->root = ctx;
+    ctx->max_depth = max_depth;
+    ctx->depth = 0;
+    ctx->undo = ncalloc(max_depth, sizeof(*ctx->undo), ctx);
+    ctx->drops = ncalloc(max_depth, sizeof(*ctx->drops), ctx);
+    ctx->best_moves = ncalloc(max_depth, sizeof(*ctx->best_moves), ctx);
+    ctx->seq = ncalloc(max_depth, sizeof(*ctx->seq), ctx);
+
+    if (opts && opts->tt_bits > 0)
+        ctx->tt = tt_new(opts->tt_bits, ctx);
+    if (opts && opts->beam_width > 0)
+        ctx->beam = beam_new(height, width, opts->beam_width, ctx);
+    if (opts && opts->batch_eval) {
+        /* At most 4 rotations of a piece at every column */
+        ctx->batch = eval_batch_new(width, 4 * width, ctx);
+        ctx->batch_moves = ncalloc(4 * width, sizeof(*ctx->batch_moves), ctx);
+        ctx->batch_vals = ncalloc(4 * width, sizeof(*ctx->batch_vals), ctx);
+    }
+
+    if (opts && opts->n_threads > 1) {
+        int n = opts->n_threads;
+        search_opts_t worker_opts = *opts;
+        worker_opts.n_threads = 1;
+        worker_opts.prune_check = false;
+
+        ctx->pool = pool_new(n);
+        ctx->workers = ncalloc(n, sizeof(*ctx->workers), ctx);
+        for (int i = 0; i < n; i++) {
+            search_ctx_t *wc =
+                search_ctx_new(height, width, max_depth, &worker_opts);
+            wc->board = grid_new(height, width);
+            nalloc_set_parent(wc->board, wc);
+            nalloc_set_parent(wc, ctx->workers);
+            wc->root = ctx;
+            ctx->workers[i] = wc;
+        }
+    }
+    ctx->root_moves = ncalloc(4 * width, sizeof(*ctx->root_moves), ctx);
+    ctx->root_vals = ncalloc(4 * width, sizeof(*ctx->root_vals), ctx);
+    ctx->root_order = ncalloc(4 * width, sizeof(*ctx->root_order), ctx);
+    if (opts && opts->budget_us > 0)
+        ctx->budget_us = opts->budget_us;
+
+    if (opts && opts->expect) {
+        ctx->expect = true;
+        ctx->expect_nodes = opts->expect_nodes > 0 ? opts->expect_nodes : 0;
+        ctx->expect_cache = ncalloc(1 << EXPECT_CACHE_BITS,
+                                    sizeof(*ctx->expect_cache), ctx);
+    }
+
+    for (int i = 0; opts && i < PRUNE_DEPTHS; i++)
+        ctx->pruning |= opts->prune_top[i] > 0;
+    if (opts && opts->prune_margin > 0)
+        ctx->pruning = true;
+    if (ctx->pruning) {
+        memcpy(ctx->prune_top, opts->prune_top, sizeof(ctx->prune_top));
+        ctx->prune_margin = opts->prune_margin;
+        ctx->cand_stride = 4 * width;
+        ctx->cand = ncalloc(max_depth * ctx->cand_stride, sizeof(*ctx->cand),
+                            ctx);
+        if (opts->prune_check) {
+            search_opts_t exact_opts = *opts;
+            memset(exact_opts.prune_top, 0, sizeof(exact_opts.prune_top));
+            exact_opts.prune_margin = 0;
+            exact_opts.prune_check = false;
+            ctx->exact = search_ctx_new(height, width, max_depth, &exact_opts);
+        }
+    }
+    return ctx;
+}
+
+void search_ctx_free(search_ctx_t *ctx)
+{
+    if (!ctx)
+        return;
+    pool_free(ctx->pool);
+    search_ctx_free(ctx->exact);
+    nfree(ctx);
+}
+
+void search_ctx_stop(search_ctx_t *ctx, bool stop)
+{
+    atomic_store_explicit(&ctx->stop, stop, memory_order_relaxed);
+}
+
+void search_ctx_stats(const search_ctx_t *ctx, search_stats_t *st)
+{
+    search_stats_merge(st, &ctx->st);
+    if (ctx->tt)
+        tt_stats_add(ctx->tt, st);
+    if (ctx->beam)
+        beam_stats_add(ctx->beam, st);
+    if (ctx->pool) {
+        for (int i = 0; i < pool_size(ctx->pool); i++)
+            search_ctx_stats(ctx->workers[i], st);
+    }
+}
+
+float search_ctx_value(const search_ctx_t *ctx)
+{
+    return ctx->value;
+}
+
+static move_t *best_move_rec(search_ctx_t *ctx,
+                             grid_t *g,
+                             float *w,
+                             int depth_left,
+                             float *value,
+                             int relief_max);
+
+static inline int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Index of the first largest of the n > 0 values */
+static size_t argmax(const float *v, size_t n)
+{
+    size_t best = 0;
+    for (size_t i = 1; i < n; i++) {
+        if (v[i] > v[best])
+            best = i;
+    }
+    return best;
+}
+
+/* Drop every placement of the piece at depth on g, the board of the node
+ * whose children place it
+ */
+static void drops_prepare(search_ctx_t *ctx, const grid_t *g, int depth)
+{
+    const shape_t *s = ctx->seq[depth];
+    grid_place_drops(g, s, g->height - s->max_dim_len, 0, g->width,
+                     ctx->drops[depth].base);
+}
+
+/* Landing rows of the node at depth, from its parent's, redropping only
+ * the placements over the columns the parent's placement changed
+ */
+static void drops_node(search_ctx_t *ctx, const grid_t *g, int depth)
+{
+    const shape_t *s = ctx->seq[depth];
+    drop_cache_t *dc = &ctx->drops[depth];
+    memcpy(dc->node, dc->base, sizeof(dc->node));
+    int n = grid_place_drops(g, s, g->height - s->max_dim_len, dc->lo, dc->hi,
+                             dc->node);
+#if SEARCH_STATS
+    int all = 0;
+    for (int r = 0; r < s->n_rot; r++)
+        all += g->width - s->rot_wh[r].x + 1;
+    STATS_ADD(&ctx->st, drops, all);
+    STATS_ADD(&ctx->st, drop_hits, all - n);
+#else
+    (void) n;
+#endif
+}
+
+/* Landing row of p, of the piece at depth, dropped from row y */
+static inline int node_drop(search_ctx_t *ctx,
+                            const grid_t *g,
+                            const placement_t *p,
+                            int y,
+                            int depth)
+{
+    if (depth) {
+        int land = ctx->drops[depth].node[p->rot][p->col];
+        if (land >= 0)
+            return land;
+    }
+    return grid_place_drop(g, p, y);
+}
+
+/* Start a new generation of cached chance values if the weights changed */
+static void expect_weights(search_ctx_t *ctx, const float *w)
+{
+    if (!ctx->expect_gen || memcmp(ctx->expect_w, w, sizeof(ctx->expect_w))) {
+        memcpy(ctx->expect_w, w, sizeof(ctx->expect_w));
+        ctx->expect_gen++;
+    }
+}
+
+/* Value of a board past the preview: the average, over every shape, of the
+ * best value of the board once that shape is placed. Every root placement
+ * has the same share of the budget, so the moves do not depend on the order
+ * the root is searched in. Every chance node visited spends one unit, taken
+ * from the cache or not, and the transposition table is off, so what is
+ * already cached never changes the moves either.
+ */
+static float chance_value(search_ctx_t *ctx, grid_t *g, float *w)
 {
-    float *w = malloc(sizeof(predefined_weights));
-    memcpy(w, predefined_weights, sizeof(predefined_weights));
-    return w;
+    if (ctx->expect_left <= 0) {
+        STATS_ADD(&ctx->st, expect_cutoffs, 1);
+        STATS_ADD(&ctx->st, leaves, 1);
+        return grid_eval(g, w);
+    }
+    ctx->expect_left--;
+    STATS_ADD(&ctx->st, expect_nodes, 1);
+
+    expect_entry_t *e =
+        &ctx->expect_cache[g->hash & ((1 << EXPECT_CACHE_BITS) - 1)];
+    if (e->gen == ctx->expect_gen && e->hash == g->hash) {
+        STATS_ADD(&ctx->st, expect_hits, 1);
+        return e->value;
+    }
+
+    /* A shape that does not fit ends the game: weigh it as the worst value,
+     * scaled down so that the sum stays finite.
+     */
+    int n = shapes_count();
+    float sum = 0;
+    for (int k = 0; k < n; k++) {
+        const shape_t *s = shape_get(k);
+        bool nocheck = (g->height - 1 - g->relief_max) >= s->max_dim_len;
+        int elevated = g->height - s->max_dim_len;
+        float best = MOST_NEG_FLOAT;
+        for (int r = 0; r < s->n_rot; r++) {
+            const placement_t *p = s->place[r];
+            const placement_t *end = p + g->width - s->rot_wh[r].x + 1;
+            for (; p < end; p++) {
+                if (!nocheck && grid_place_intersects(g, p, elevated))
+                    continue;
+                int land = grid_place_drop(g, p, elevated);
+                grid_place_add(g, p, land);
+                grid_clear_lines_undoable(g, &ctx->expect_undo);
+                float v = grid_eval(g, w);
+                grid_clear_lines_undo(g, &ctx->expect_undo);
+                grid_place_remove(g, p, land);
+                best = v > best ? v : best;
+                STATS_ADD(&ctx->st, leaves, 1);
+            }
+        }
+        sum += best / n;
+    }
+
+    *e = (expect_entry_t){g->hash, sum, ctx->expect_gen};
+    return sum;
 }
 
-static void feature_variance(const grid_t *g, float *raws)
+/* Drop p from row y, search the rest of the preview on the resulting board,
+ * then take p back off. With a batch, a leaf is only snapshotted into it and
+ * scored later.
+ */
+static float search_placement(search_ctx_t *ctx,
+                              grid_t *g,
+                              const placement_t *p,
+                              int y,
+                              float *w,
+                              int depth_left,
+                              int relief_max,
+                              eval_batch_t *batch)
 {
-    float avg = 0, var = 0, max = 0;
-    int width = g->width;
+    if (depth_left == ctx->depth - 1)
+        ctx->expect_left = ctx->expect_per_root;
+
+    int depth = ctx->depth - depth_left - 1;
+    int land = node_drop(ctx, g, p, y, depth);
+    grid_place_add(g, p, land);
+    int new_relief_mx = MAX(relief_max, land + p->height - 1);
 
-    int discont = -1, last_height = -1;
-    int gaps = 0, obs = 0;
-    for (int i = 0; i < width; i++) {
-        int height = g->relief[i];
-        if (height > max)
-            max = height;
-        avg += height + 1;
-        discont += (int) (last_height != height);
-        last_height = height;
+    /* Clear lines in place, and put them back once the subtree is done */
+    grid_undo_t *undo = &ctx->undo[depth_left];
+    bool cleared = grid_clear_lines_undoable(g, undo);
+    if (cleared)
+        STATS_ADD(&ctx->st, clears, 1);
 
-        int cgaps = g->gaps[i];
-        gaps += cgaps;
-        obs += height - cgaps;
+    /* A clear moves every column, otherwise only those under p changed */
+    if (depth_left) {
+        drop_cache_t *dc = &ctx->drops[depth + 1];
+        dc->lo = cleared ? 0 : p->col;
+        dc->hi = cleared ? g->width
+                         : p->col + ctx->seq[depth]->rot_wh[p->rot].x;
     }
-    avg /= width;
 
-    for (int i = 0; i < width; i++) {
-        float diff = avg - g->relief[i];
-        var += diff * diff;
+    float curr = 0;
+    if (depth_left) {
+        best_move_rec(ctx, g, w, depth_left - 1, &curr, new_relief_mx);
+    } else if (ctx->expect) {
+        curr = chance_value(ctx, g, w);
+    } else if (batch) {
+        eval_batch_push(batch, g);
+        STATS_ADD(&ctx->st, leaves, 1);
+    } else {
+        curr = grid_eval(g, w);
+        STATS_ADD(&ctx->st, leaves, 1);
     }
 
-    raws[FEATIDX_RELIEF_MAX] = max;
-    raws[FEATIDX_RELIEF_AVG] = avg;
-    raws[FEATIDX_RELIEF_VAR] = var;
-    raws[FEATIDX_DISCONT] = discont;
-    raws[FEATIDX_GAPS] = gaps;
-    raws[FEATIDX_OBS] = obs;
+    grid_clear_lines_undo(g, undo);
+    grid_place_remove(g, p, land);
+    return curr;
 }
 
-static float grid_eval(grid_t *g, const float *weights)
+/* Insertion sort, as there are at most 4 * width candidates */
+static void cands_sort(prune_cand_t *c, int n, bool by_value)
 {
-    float raws[N_FEATIDX];
-    feature_variance(g, raws);
-    float val = 0;
-    for (int i = 0; i < N_FEATIDX; i++)
-        val += raws[i] * weights[i];
-    return val;
+    for (int i = 1; i < n; i++) {
+        prune_cand_t x = c[i];
+        int j = i;
+        for (; j > 0; j--) {
+            bool before = by_value ? x.value > c[j - 1].value ||
+                                         (x.value == c[j - 1].value &&
+                                          x.idx < c[j - 1].idx)
+                                   : x.idx < c[j - 1].idx;
+            if (!before)
+                break;
+            c[j] = c[j - 1];
+        }
+        c[j] = x;
+    }
 }
 
-static grid_t **grids = NULL;
-static block_t **blocks = NULL;
-static move_t **best_moves = NULL;
+/* Rank the placements of the piece at depth by their one-piece value, and
+ * keep the best prune_top ones that are within prune_margin of the best.
+ * Return how many are kept, left in (rot, col) order at the front of the
+ * depth's candidates, so that ties go to the same move as unpruned.
+ */
+static int prune_cands(search_ctx_t *ctx,
+                       grid_t *g,
+                       float *w,
+                       int depth,
+                       int depth_left,
+                       int relief_max)
+{
+    const shape_t *s = ctx->seq[depth];
+    prune_cand_t *cand = ctx->cand + depth * ctx->cand_stride;
+    bool nocheck = (g->height - 1 - relief_max) >= s->max_dim_len;
+    int elevated = g->height - s->max_dim_len;
+    grid_undo_t *undo = &ctx->undo[depth_left];
+
+    int n = 0;
+    for (int r = 0; r < s->n_rot; r++) {
+        const placement_t *p = s->place[r];
+        const placement_t *end = p + g->width - s->rot_wh[r].x + 1;
+        if (nocheck)
+            STATS_ADD(&ctx->st, nocheck_skips, end - p);
+        else
+            STATS_ADD(&ctx->st, intersect_tests, end - p);
+        for (; p < end; p++) {
+            if (!nocheck && grid_place_intersects(g, p, elevated))
+                continue;
+            int land = node_drop(ctx, g, p, elevated, depth);
+            grid_place_add(g, p, land);
+            grid_clear_lines_undoable(g, undo);
+            cand[n] = (prune_cand_t){p, grid_eval(g, w), n};
+            n++;
+            grid_clear_lines_undo(g, undo);
+            grid_place_remove(g, p, land);
+        }
+    }
+    STATS_ADD(&ctx->st, prune_evals, n);
+
+    int top = ctx->prune_top[depth < PRUNE_DEPTHS ? depth : PRUNE_DEPTHS - 1];
+    if ((!top || top >= n) && ctx->prune_margin <= 0)
+        return n;
 
-static move_t *best_move_rec(grid_t *g,
-                             shape_stream_t *stream,
+    cands_sort(cand, n, true);
+    int k = top && top < n ? top : n;
+    if (ctx->prune_margin > 0) {
+        while (k > 1 && cand[k - 1].value < cand[0].value - ctx->prune_margin)
+            k--;
+    }
+    STATS_ADD(&ctx->st, prune_cuts, n - k);
+    cands_sort(cand, k, false);
+    return k;
+}
+
+#if SEARCH_SPANS
+static const char *const span_depth[] = {
+    "depth 0", "depth 1", "depth 2", "depth 3",
+    "depth 4", "depth 5", "depth 6", "depth 7+",
+};
+#endif
+
+static move_t *best_move_rec(search_ctx_t *ctx,
+                             grid_t *g,
                              float *w,
                              int depth_left,
                              float *value,
@@ -90,93 +492,383 @@ static move_t *best_move_rec(grid_t *g,
 {
     float score = MOST_NEG_FLOAT;
 
-    int depth = stream->max_len - depth_left - 1;
-    shape_t *s = shape_stream_peek(stream, depth);
-    block_t *b = blocks[depth_left];
-    move_t *best = best_moves[depth_left];
+    int depth = ctx->depth - depth_left - 1;
+    const shape_t *s = ctx->seq[depth];
+    move_t *best = &ctx->best_moves[depth_left];
 
-    /* In cases when we need to clear lines */
-    grid_t *g_prime = grids[depth_left]; /* depth_left: 0...ss->max_len-1 */
+    /* Only the value of an inner node is needed, never its move. With
+     * expectimax, a hit would skip the chance nodes of the subtree and leave
+     * their budget to the next ones, so the table is not used.
+     */
+    bool use_tt = ctx->tt && depth && !ctx->expect;
+    if (use_tt && tt_probe(ctx->tt, g->hash, depth_left, value))
+        return best;
 
-    best->shape = s;
-    int max_rots = s->n_rot;
-    b->shape = s;
-    bool nocheck = (g->height - 1 - relief_max) >= b->shape->max_dim_len;
-    int elevated = g->height - b->shape->max_dim_len;
+    /* Past the deadline, or when told to stop, unwind without searching any
+     * further. The values returned from then on are meaningless and must not
+     * be stored.
+     */
+    if (ctx->deadline &&
+        (ctx->aborted || now_ns() >= ctx->deadline ||
+         atomic_load_explicit(&ctx->root->stop, memory_order_relaxed))) {
+        ctx->aborted = true;
+        *value = MOST_NEG_FLOAT;
+        return best;
+    }
+    STATS_ADD(&ctx->st, nodes[depth < STATS_DEPTHS ? depth : STATS_DEPTHS - 1],
+              1);
+    SPAN_BEGIN(span_depth[depth < 8 ? depth : 7]);
 
-    /* FIXME: it should be taken from grid_block_elevate */
-    b->offset.y = elevated;
+    /* Children share the drops of the next piece on this board */
+    if (depth)
+        drops_node(ctx, g, depth);
+    if (depth_left)
+        drops_prepare(ctx, g, depth + 1);
 
-    for (int r = 0; r < max_rots; r++) {
-        b->rot = r;
-        int max_cols = g->width - s->rot_wh[r].x + 1;
-        b->offset.y = elevated;
-        int top_elevated = block_extreme(b, TOP);
-        for (int c = 0; c < max_cols; c++) {
-            b->offset.x = c;
-            b->offset.y = elevated;
-            if (!nocheck && grid_block_intersects(g, b))
-                continue;
-
-            int amt = grid_block_drop(g, b);
-            grid_block_add(g, b);
-            int new_relief_mx = MAX(relief_max, top_elevated - amt);
-
-            grid_t *g_rec;
-            if (g->n_full_rows) {
-                g_rec = g_prime;
-                grid_cpy(g_rec, g);
-                grid_clear_lines(g_rec);
-            } else {
-                g_rec = g;
-            }
+    best->shape = s;
+    bool nocheck = (g->height - 1 - relief_max) >= s->max_dim_len;
+    int elevated = g->height - s->max_dim_len;
 
-            float curr;
-            if (depth_left) {
-                best_move_rec(g_rec, stream, w, depth_left - 1, &curr,
-                              new_relief_mx);
-            } else {
-                curr = grid_eval(g_rec, w);
-            }
+    /* Leaves are one-piece values already, so only inner nodes are pruned */
+    if (ctx->pruning && depth_left) {
+        int k = prune_cands(ctx, g, w, depth, depth_left, relief_max);
+        const prune_cand_t *cand = ctx->cand + depth * ctx->cand_stride;
+        for (int i = 0; i < k; i++) {
+            float curr = search_placement(ctx, g, cand[i].p, elevated, w,
+                                          depth_left, relief_max, NULL);
             if (curr > score) {
                 score = curr;
-                best->rot = r;
-                best->col = c;
+                best->rot = cand[i].p->rot;
+                best->col = cand[i].p->col;
             }
+        }
+        goto done;
+    }
+
+    eval_batch_t *batch = depth_left || ctx->expect ? NULL : ctx->batch;
+    if (batch)
+        batch->n = 0;
+
+    for (int r = 0; r < s->n_rot; r++) {
+        const placement_t *p = s->place[r];
+        const placement_t *end = p + g->width - s->rot_wh[r].x + 1;
+        if (nocheck)
+            STATS_ADD(&ctx->st, nocheck_skips, end - p);
+        else
+            STATS_ADD(&ctx->st, intersect_tests, end - p);
+        for (; p < end; p++) {
+            if (!nocheck && grid_place_intersects(g, p, elevated))
+                continue;
 
-            grid_block_remove(g, b);
+            float curr = search_placement(ctx, g, p, elevated, w, depth_left,
+                                          relief_max, batch);
+            if (batch) {
+                ctx->batch_moves[batch->n - 1] = (move_t){s, p->rot, p->col};
+            } else if (curr > score) {
+                score = curr;
+                best->rot = p->rot;
+                best->col = p->col;
+            }
         }
     }
+
+    /* Score all leaves at once. Ties go to the first, as in the loop above. */
+    if (batch && batch->n) {
+        grid_eval_batch(w, batch, batch->n, ctx->batch_vals);
+        size_t i = argmax(ctx->batch_vals, batch->n);
+        score = ctx->batch_vals[i];
+        best->rot = ctx->batch_moves[i].rot;
+        best->col = ctx->batch_moves[i].col;
+    }
+done:
+    SPAN_END();
+    if (use_tt && !ctx->aborted)
+        tt_store(ctx->tt, g->hash, depth_left, score);
     *value = score;
     return best;
 }
 
-static int n_grids = 0;
+/* Value of root placement m, searched with ctx */
+static float root_value(search_ctx_t *ctx,
+                        grid_t *g,
+                        const move_t *m,
+                        float *w,
+                        int relief_max)
+{
+    const shape_t *s = m->shape;
+    const placement_t *p = &s->place[m->rot][m->col];
+    int elevated = g->height - s->max_dim_len;
+
+    bool nocheck = (g->height - 1 - relief_max) >= s->max_dim_len;
+    if (nocheck)
+        STATS_ADD(&ctx->st, nocheck_skips, 1);
+    else
+        STATS_ADD(&ctx->st, intersect_tests, 1);
+    if (!nocheck && grid_place_intersects(g, p, elevated))
+        return MOST_NEG_FLOAT;
+    return search_placement(ctx, g, p, elevated, w, ctx->depth - 1,
+                            relief_max, NULL);
+}
 
-move_t *best_move(grid_t *g, block_t *b, shape_stream_t *ss, float *w)
+/* List the root placements in (rot, col) order, to be searched in order.
+ * Pruning keeps the same ones as best_move_rec would at the root.
+ */
+static void root_moves_init(search_ctx_t *ctx,
+                            grid_t *g,
+                            float *w,
+                            int relief_max)
 {
-    if (n_grids < ss->max_len) {
-        int depth = ss->max_len;
-        grids = ncalloc(depth, sizeof(*grids), g);
-        blocks = ncalloc(depth, sizeof(*blocks), b);
-        best_moves = nrealloc(best_moves, depth * sizeof(*best_moves));
-        nalloc_set_parent(best_moves, grids);
-        for (int i = n_grids; i < ss->max_len; i++) {
-            grids[i] = grid_new(g->height, g->width);
-            nalloc_set_parent(grids[i], grids);
-            blocks[i] = block_new();
-            nalloc_set_parent(blocks[i], blocks);
-            best_moves[i] = nalloc(sizeof(*best_moves[i]), best_moves);
-            nalloc_set_parent(best_moves[i], best_moves);
+    const shape_t *s = ctx->seq[0];
+    int n = 0;
+
+    if (ctx->pruning && ctx->depth > 1) {
+        n = prune_cands(ctx, g, w, 0, ctx->depth - 1, relief_max);
+        for (int i = 0; i < n; i++) {
+            const placement_t *p = ctx->cand[i].p;
+            ctx->root_order[i] = i;
+            ctx->root_moves[i] = (move_t){s, p->rot, p->col};
+        }
+        /* With no room for the piece, let the search find nothing */
+        if (n) {
+            ctx->n_root = n;
+            return;
         }
-        n_grids = ss->max_len;
     }
 
-    int relief_mx = -1;
-    for (int i = 0; i < g->width; i++)
-        relief_mx = MAX(relief_mx, g->relief[i]);
+    for (int r = 0; r < s->n_rot; r++) {
+        int max_cols = g->width - s->rot_wh[r].x + 1;
+        for (int c = 0; c < max_cols; c++) {
+            ctx->root_order[n] = n;
+            ctx->root_moves[n++] = (move_t){s, r, c};
+        }
+    }
+    ctx->n_root = n;
+}
+
+/* Best root placement. Ties go to the first in (rot, col) order, whatever
+ * order they were searched in, like the serial search.
+ */
+static move_t *root_best(search_ctx_t *ctx, float *value)
+{
+    move_t *best = &ctx->best_moves[ctx->depth - 1];
+    size_t i = argmax(ctx->root_vals, ctx->n_root);
+    *best = ctx->root_moves[i];
+    *value = ctx->root_vals[i];
+    return best;
+}
+
+/* Search the subtree below one root placement on a worker's private board */
+static void root_task(void *arg, int worker, int task)
+{
+    search_ctx_t *ctx = arg;
+    search_ctx_t *wc = ctx->workers[worker];
+
+    if (wc->run != ctx->run) {
+        grid_cpy(wc->board, ctx->root_grid);
+        STATS_ADD(&wc->st, grid_cpys, 1);
+        wc->depth = ctx->depth;
+        memcpy(wc->seq, ctx->seq, ctx->depth * sizeof(*ctx->seq));
+        wc->deadline = ctx->deadline;
+        wc->aborted = false;
+        wc->run = ctx->run;
+        wc->expect_per_root = ctx->expect_per_root;
+        if (wc->expect)
+            expect_weights(wc, ctx->root_w);
+        if (wc->tt)
+            tt_new_search(wc->tt);
+        if (wc->depth > 1)
+            drops_prepare(wc, wc->board, 1);
+    }
+
+    int i = ctx->root_order[task];
+    ctx->root_vals[i] = wc->aborted ? MOST_NEG_FLOAT
+                                    : root_value(wc, wc->board,
+                                                 &ctx->root_moves[i],
+                                                 ctx->root_w,
+                                                 ctx->root_relief_max);
+}
+
+/* Value every root placement, in root_order, serially or over the pool.
+ * Return false if the deadline cut the search short.
+ */
+static bool root_search(search_ctx_t *ctx, grid_t *g, float *w, int relief_max)
+{
+    ctx->aborted = false;
+    STATS_ADD(&ctx->st, nodes[0], 1);
+    if (!ctx->pool) {
+        if (ctx->depth > 1)
+            drops_prepare(ctx, g, 1);
+        for (int k = 0; k < ctx->n_root && !ctx->aborted; k++) {
+            int i = ctx->root_order[k];
+            ctx->root_vals[i] =
+                root_value(ctx, g, &ctx->root_moves[i], w, relief_max);
+        }
+        return !ctx->aborted;
+    }
+
+    ctx->root_grid = g;
+    ctx->root_w = w;
+    ctx->root_relief_max = relief_max;
+    ctx->run++;
+    pool_run(ctx->pool, ctx->n_root, root_task, ctx);
+
+    for (int i = 0; i < pool_size(ctx->pool); i++) {
+        search_ctx_t *wc = ctx->workers[i];
+        if (wc->run == ctx->run && wc->aborted)
+            return false;
+    }
+    return true;
+}
+
+/* Same result as best_move_rec at the root, with the root placements spread
+ * over the pool.
+ */
+static move_t *best_move_par(search_ctx_t *ctx,
+                             grid_t *g,
+                             float *w,
+                             float *value,
+                             int relief_max)
+{
+    root_moves_init(ctx, g, w, relief_max);
+    root_search(ctx, g, w, relief_max);
+    return root_best(ctx, value);
+}
+
+/* Search the first 1, 2, ... pieces of the preview until the budget runs out,
+ * and keep the best move of the deepest search that completed. Every
+ * iteration searches the root placements best first, by the values of the
+ * previous one. The one-piece search always completes.
+ */
+static move_t *best_move_anytime(search_ctx_t *ctx,
+                                 grid_t *g,
+                                 float *w,
+                                 float *value,
+                                 int relief_max)
+{
+    int full_depth = ctx->depth;
+    int64_t deadline = now_ns() + (int64_t) ctx->budget_us * 1000;
+    move_t *best = &ctx->best_moves[full_depth - 1], found;
+
+    root_moves_init(ctx, g, w, relief_max);
+    for (int d = 1; d <= full_depth; d++) {
+        ctx->depth = d;
+        ctx->deadline = d > 1 ? deadline : 0;
+        /* Entries are keyed by depth left, whose piece changes with d */
+        if (ctx->tt && d > 1)
+            tt_new_search(ctx->tt);
+        if (!root_search(ctx, g, w, relief_max))
+            break;
+        found = *root_best(ctx, value);
+
+        /* Stable, so equal values keep their (rot, col) order */
+        int *order = ctx->root_order;
+        for (int i = 1; i < ctx->n_root; i++) {
+            for (int j = i; j > 0 && ctx->root_vals[order[j]] >
+                                         ctx->root_vals[order[j - 1]];
+                 j--) {
+                int tmp = order[j];
+                order[j] = order[j - 1];
+                order[j - 1] = tmp;
+            }
+        }
+        if (now_ns() >= deadline)
+            break;
+    }
+    ctx->depth = full_depth;
+    ctx->deadline = 0;
+    *best = found;
+    return best;
+}
+
+/* Search the first ctx->depth pieces of ctx->seq */
+static move_t *best_move_run(search_ctx_t *ctx, grid_t *g, float *w)
+{
+#if SEARCH_STATS
+    int64_t start = now_ns();
+#endif
+    SPAN_BEGIN("best_move");
+    if (ctx->tt)
+        tt_new_search(ctx->tt);
+
+    int relief_mx = g->relief_max;
+
+    if (ctx->expect) {
+        expect_weights(ctx, w);
+        const shape_t *s = ctx->seq[0];
+        int n = 0;
+        for (int r = 0; r < s->n_rot; r++)
+            n += g->width - s->rot_wh[r].x + 1;
+        ctx->expect_per_root =
+            ctx->expect_nodes ? MAX(1, ctx->expect_nodes / n) : INT_MAX;
+    }
 
     float val;
-    move_t *best = best_move_rec(g, ss, w, ss->max_len - 1, &val, relief_mx);
+    move_t *best;
+    if (ctx->beam) {
+        best = &ctx->best_moves[ctx->depth - 1];
+        val = beam_search(ctx->beam, g, ctx->seq, ctx->depth, w, best);
+    } else if (ctx->budget_us)
+        best = best_move_anytime(ctx, g, w, &val, relief_mx);
+    else if (ctx->pool)
+        best = best_move_par(ctx, g, w, &val, relief_mx);
+    else
+        best = best_move_rec(ctx, g, w, ctx->depth - 1, &val, relief_mx);
+    SPAN_END();
+#if SEARCH_STATS
+    search_stats_move(&ctx->st, now_ns() - start);
+#endif
+    ctx->value = val;
+
+    /* Untimed: how often the exhaustive search picks the same move */
+    if (SEARCH_STATS && ctx->exact) {
+        move_t *m = best_move_seq(ctx->exact, g, ctx->seq, ctx->depth, w);
+        STATS_ADD(&ctx->st, prune_checks, 1);
+        if (val == MOST_NEG_FLOAT ? !m
+                                  : m && m->rot == best->rot &&
+                                        m->col == best->col)
+            STATS_ADD(&ctx->st, prune_agree, 1);
+    }
     return val == MOST_NEG_FLOAT ? NULL : best;
-}
\ No newline at end of file
+}
+
+move_t *best_move_ctx(search_ctx_t *ctx,
+                      grid_t *g,
+                      shape_stream_t *ss,
+                      float *w)
+{
+    /* Take the whole preview up front, so the search never touches the
+     * stream itself.
+     */
+    ctx->depth = ss->max_len < ctx->max_depth ? ss->max_len : ctx->max_depth;
+    for (int i = 0; i < ctx->depth; i++)
+        ctx->seq[i] = shape_stream_peek(ss, i);
+    return best_move_run(ctx, g, w);
+}
+
+move_t *best_move_seq(search_ctx_t *ctx,
+                      grid_t *g,
+                      const shape_t **seq,
+                      int n,
+                      float *w)
+{
+    ctx->depth = n < ctx->max_depth ? n : ctx->max_depth;
+    memcpy(ctx->seq, seq, ctx->depth * sizeof(*seq));
+    return best_move_run(ctx, g, w);
+}
+
+move_t *best_move(grid_t *g, shape_stream_t *ss, float *w)
+{
+    /* Shared context for callers that do not manage their own. It is
+     * reallocated whenever the board or the preview outgrows it.
+     */
+    static search_ctx_t *ctx = NULL;
+    static int ctx_height, ctx_width;
+
+    if (!ctx || ctx->max_depth < ss->max_len || ctx_height != g->height ||
+        ctx_width != g->width) {
+        search_ctx_free(ctx);
+        ctx = search_ctx_new(g->height, g->width, ss->max_len, NULL);
+        ctx_height = g->height, ctx_width = g->width;
+    }
+    return best_move_ctx(ctx, g, ss, w);
+}
@@ -4,10 +4,10 @@
  *
  * Each chunk of nalloc'ed memory has a header of the following form:
  *
- * +---------+---------+---------+--------···
- * |  first  |  next   |  prev   | memory
- * |  child  | sibling | sibling | chunk
- * +---------+---------+---------+--------···
+ * +---------+---------+---------+---------+--------···
+ * |  first  |  next   |  prev   | region  | memory
+ * |  child  | sibling | sibling |         | chunk
+ * +---------+---------+---------+---------+--------···
  *
  * Thus, a nalloc hierarchy tree would look like this:
  *
@@ -21,6 +21,19 @@
  *                                                |          |
  *                                                v          v
  *                                               NULL       NULL
+ *
+ * The region field is NULL for chunks obtained from malloc. Chunks allocated
+ * under a region root instead point to the arena of that region, and are
+ * carved out of its blocks by bumping a pointer:
+ *
+ *   arena --> block --> block --> NULL
+ *     |         |
+ *     v         v
+ *   root      | size | header | memory | size | header | memory | ···
+ *
+ * The root itself is an ordinary malloc'ed chunk whose region field points to
+ * its own arena. Releasing the root releases the arena blocks without
+ * walking the tree below it.
  */
 
 #include <assert.h>
@@ -39,33 +52,119 @@
  * Nalloc tree node helpers.
  */
 
-#define HEADER_SIZE (sizeof(void *) * 3)
+#define HEADER_SIZE (sizeof(void *) * 4)
 
-#define raw2usr(mem) (void *) ((void **) (mem) + 3)
-#define usr2raw(mem) (void *) ((void **) (mem) -3)
-#define child(mem) (((void **) (mem))[-3])
-#define next(mem) (((void **) (mem))[-2])
-#define prev(mem) (((void **) (mem))[-1])
+#define raw2usr(mem) (void *) ((void **) (mem) + 4)
+#define usr2raw(mem) (void *) ((void **) (mem) -4)
+#define child(mem) (((void **) (mem))[-4])
+#define next(mem) (((void **) (mem))[-3])
+#define prev(mem) (((void **) (mem))[-2])
+#define region(mem) (((void **) (mem))[-1])
 #define parent(mem) prev(mem) /* Valid only when is_first(mem) */
 #define is_root(mem) (!prev(mem))
 #define is_first(mem) (next(prev(mem)) != (mem))
 
+/**
+ * Region helpers.
+ */
+
+#define ARENA_BLOCK_SIZE 4096
+#define ARENA_BLOCK_MAX (1 << 20)
+
+/* Arena chunks are prefixed by their size, padded to keep memory aligned */
+#define ARENA_PREFIX 16
+#define ALIGN16(n) (((n) + 15) & ~(size_t) 15)
+#define arena_size(mem) (*(size_t *) ((char *) usr2raw(mem) - ARENA_PREFIX))
+
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t used, cap;
+    max_align_t data[];
+} arena_block_t;
+
+typedef struct {
+    void *root;
+    arena_block_t *blocks;
+    size_t block_size;
+} arena_t;
+
+#define is_region(mem) \
+    (region(mem) && ((arena_t *) region(mem))->root == (mem))
+#define in_arena(mem) (region(mem) && !is_region(mem))
+
+/* Arena serving the children of mem, if any */
+#define scope(mem) ((mem) ? (arena_t *) region(mem) : NULL)
+
+/* Arena holding the memory of mem itself, if any */
+#define home(mem) (in_arena(mem) ? (arena_t *) region(mem) : NULL)
+
+/**
+ * Carve a raw chunk for size bytes of memory out of an arena.
+ *
+ * @param a     arena.
+ * @param size  amount of memory requested (in bytes).
+ *
+ * @return pointer to the raw chunk (header included), or NULL on error.
+ */
+static void *arena_alloc(arena_t *a, size_t size)
+{
+    size_t need = ALIGN16(ARENA_PREFIX + HEADER_SIZE + size);
+    arena_block_t *b = a->blocks;
+
+    if (!b || b->cap - b->used < need) {
+        size_t cap = a->block_size;
+        while (cap < need)
+            cap *= 2;
+        if (unlikely(!(b = malloc(sizeof(*b) + cap))))
+            return NULL;
+        b->next = a->blocks;
+        b->used = 0;
+        b->cap = cap;
+        a->blocks = b;
+        if (a->block_size < ARENA_BLOCK_MAX)
+            a->block_size *= 2;
+    }
+
+    char *p = (char *) b->data + b->used;
+    b->used += need;
+    *(size_t *) p = size;
+    return p + ARENA_PREFIX;
+}
+
+/**
+ * Release a region root along with every chunk of its arena.
+ *
+ * @param mem  pointer to a region root, already detached from its tree.
+ */
+static void region_release(void *mem)
+{
+    arena_t *a = region(mem);
+    for (arena_block_t *b = a->blocks, *nxt; b; b = nxt) {
+        nxt = b->next;
+        free(b);
+    }
+    free(a);
+    free(usr2raw(mem));
+}
+
 /**
  * Initialize a raw chunk of memory.
  *
  * @param mem     pointer to a raw memory chunk.
+ * @param region  arena the chunk belongs to, or NULL.
  * @param parent  pointer to previously nalloc'ed memory chunk from which this
  *                chunk depends, or NULL.
  *
  * @return pointer to the allocated memory chunk, or NULL if there was an error.
  */
-static inline void *nalloc_init(void *mem, void *parent)
+static inline void *nalloc_init(void *mem, arena_t *region, void *parent)
 {
     if (unlikely(!mem))
         return NULL;
 
     memset(mem, 0, HEADER_SIZE);
     mem = raw2usr(mem);
+    region(mem) = region;
 
     nalloc_set_parent(mem, parent);
     return mem;
@@ -73,22 +172,70 @@ static inline void *nalloc_init(void *mem, void *parent)
 
 void *nalloc(size_t size, void *parent)
 {
-    return nalloc_init(malloc(size + HEADER_SIZE), parent);
+    arena_t *a = scope(parent);
+    if (a)
+        return nalloc_init(arena_alloc(a, size), a, parent);
+    return nalloc_init(malloc(size + HEADER_SIZE), NULL, parent);
 }
 
 void *ncalloc(size_t count, size_t size, void *parent)
 {
-    return nalloc_init(calloc(1, count * size + HEADER_SIZE), parent);
+    arena_t *a = scope(parent);
+    if (a) {
+        void *mem = nalloc_init(arena_alloc(a, count * size), a, parent);
+        if (mem)
+            memset(mem, 0, count * size);
+        return mem;
+    }
+    return nalloc_init(calloc(1, count * size + HEADER_SIZE), NULL, parent);
 }
 
-void *nrealloc(void *usr, size_t size)
+void *nalloc_region(size_t size, void *parent)
 {
-    void *mem = realloc(usr ? usr2raw(usr) : NULL, size + HEADER_SIZE);
+    /* Regions do not nest: inside a region, this is a plain allocation. */
+    if (scope(parent))
+        return nalloc(size, parent);
+
+    arena_t *a = malloc(sizeof(*a));
+    void *raw = malloc(size + HEADER_SIZE);
+    if (unlikely(!a || !raw)) {
+        free(a);
+        free(raw);
+        return NULL;
+    }
 
-    if (unlikely(!usr || !mem))
-        return nalloc_init(mem, NULL);
+    a->root = raw2usr(raw);
+    a->blocks = NULL;
+    a->block_size = ARENA_BLOCK_SIZE;
+    return nalloc_init(raw, a, parent);
+}
 
-    mem = raw2usr(mem);
+void *nrealloc(void *usr, size_t size)
+{
+    if (unlikely(!usr))
+        return nalloc_init(malloc(size + HEADER_SIZE), NULL, NULL);
+
+    void *mem;
+    if (in_arena(usr)) {
+        size_t old_size = arena_size(usr);
+        if (size <= old_size)
+            return usr;
+
+        void *raw = arena_alloc(region(usr), size);
+        if (unlikely(!raw))
+            return NULL;
+        memcpy(raw, usr2raw(usr), HEADER_SIZE + old_size);
+        mem = raw2usr(raw);
+    } else {
+        mem = realloc(usr2raw(usr), size + HEADER_SIZE);
+        if (unlikely(!mem))
+            return NULL;
+        mem = raw2usr(mem);
+
+        arena_t *a = region(mem);
+        if (a && a->root == usr)
+            a->root = mem;
+    }
 
     /* If the buffer starting address changed, update all references. */
     if (mem != usr) {
@@ -124,9 +271,13 @@ static inline void __nfree(void *mem)
     assert(prev(mem));
     prev(mem) = NULL;
 
-    __nfree(child(mem));
     __nfree(next(mem));
-    free(usr2raw(mem));
+    if (is_region(mem)) {
+        region_release(mem);
+    } else {
+        __nfree(child(mem));
+        free(usr2raw(mem));
+    }
 }
 
 void *nfree(void *mem)
@@ -136,8 +287,16 @@ void *nfree(void *mem)
 
     nalloc_set_parent(mem, NULL);
 
-    __nfree(child(mem));
-    free(usr2raw(mem));
+    /* Arena memory is only reclaimed along with its region. */
+    if (in_arena(mem))
+        return NULL;
+
+    if (is_region(mem)) {
+        region_release(mem);
+    } else {
+        __nfree(child(mem));
+        free(usr2raw(mem));
+    }
 
     return NULL;
 }
@@ -147,6 +306,9 @@ void nalloc_set_parent(void *mem, void *parent)
     if (unlikely(!mem))
         return;
 
+    /* Chunks can not move in or out of the arena holding them. */
+    assert(!parent || home(mem) == scope(parent));
+
     if (!is_root(mem)) {
         /* Remove node from old tree. */
         if (next(mem))
@@ -23,6 +23,12 @@
  *   }
  *   void matrix_delete(struct matrix *m) { nfree(m); }
  * @endcode
+ *
+ * A chunk allocated with nalloc_region() roots a region: every chunk that
+ * depends on it, directly or not, is carved out of one arena instead of
+ * being malloc'ed, and freeing the root releases the whole arena at once.
+ * Replacing the first allocation of matrix_new with
+ * nalloc_region(sizeof(*m), NULL) turns the matrix into a single region.
  */
 
 #pragma once
@@ -52,6 +58,22 @@ void *nalloc(size_t size, void *parent);
  */
 void *ncalloc(size_t count, size_t size, void *parent);
 
+/**
+ * Allocate a (contiguous) memory chunk that roots a region.
+ *
+ * Chunks depending on a region root are bump-allocated from the region's
+ * arena. Freeing one of them only detaches it; its memory is reclaimed when
+ * the root is freed, which releases the arena without walking the tree.
+ * If parent already belongs to a region, this is the same as nalloc.
+ *
+ * @param size    amount of memory requested (in bytes).
+ * @param parent  pointer to allocated memory chunk from which this
+ *                chunk depends, or NULL.
+ *
+ * @return pointer to the allocated memory chunk, or NULL if there was an error.
+ */
+void *nalloc_region(size_t size, void *parent);
+
 /**
  * Modify the size of a memory chunk.
  *
@@ -76,6 +98,9 @@ void *nfree(void *mem);
  * Change the parent of a memory chunk. This will affect the
  * dependencies of the entire subtree rooted at the given chunk.
  *
+ * @note Chunks can not move into or out of a region: the new parent
+ *       must belong to the same region as the chunk, or to none.
+ *
  * @param mem     pointer to allocated memory chunk.
  * @param parent  pointer to allocated memory chunk from which this
  *                chunk depends, or NULL.
@@ -0,0 +1,126 @@
+/*
+ * Pondering: while the current piece is animated, search the next one in a
+ * background thread.
+ *
+ * Only the pieces already in the preview are known, so the background search
+ * covers one piece less than a search started once the piece spawns. It is
+ * an anytime search: when the piece spawns, it is stopped and the deepest
+ * completed iteration gives the move.
+ */
+
+#include <limits.h>
+#include <pthread.h>
+
+#include "nalloc.h"
+#include "tetris.h"
+
+struct ponder {
+    search_ctx_t *ctx;
+    grid_t *board; /* the board once the current move is played */
+    const shape_t **seq;
+    int n;
+    float *w;
+
+    pthread_t thread;
+    bool running;
+    bool found;
+    move_t move;
+};
+
+ponder_t *ponder_new(int height,
+                     int width,
+                     int max_depth,
+                     const search_opts_t *opts,
+                     float *w)
+{
+    ponder_t *p = ncalloc(1, sizeof(*p), NULL);
+
+    /* Keep deepening until the piece spawns, unless a budget says otherwise */
+    search_opts_t ponder_opts = *opts;
+    if (ponder_opts.budget_us <= 0)
+        ponder_opts.budget_us = INT_MAX;
+
+    p->ctx = search_ctx_new(height, width, max_depth, &ponder_opts);
+    p->board = grid_new(height, width);
+    nalloc_set_parent(p->board, p);
+    p->seq = ncalloc(max_depth, sizeof(*p->seq), p);
+    p->w = w;
+    return p;
+}
+
+static void *ponder_main(void *arg)
+{
+    ponder_t *p = arg;
+    SPAN_THREAD("ponder", 0);
+    SPAN_BEGIN("ponder");
+    move_t *m = best_move_seq(p->ctx, p->board, p->seq, p->n, p->w);
+    p->found = m;
+    if (m)
+        p->move = *m;
+    SPAN_END();
+    return NULL;
+}
+
+/* Play m on a copy of g, and search the rest of the preview of ss from there */
+void ponder_start(ponder_t *p,
+                  const grid_t *g,
+                  const move_t *m,
+                  shape_stream_t *ss)
+{
+    p->n = ss->max_len - 1;
+    if (p->n < 1)
+        return;
+
+    grid_cpy(p->board, g);
+    block_t b;
+    block_init(&b, m->shape);
+    b.rot = m->rot;
+    b.offset.x = m->col;
+    b.offset.y = g->height - m->shape->max_dim_len;
+    if (grid_block_intersects(p->board, &b))
+        return;
+    grid_block_drop(p->board, &b);
+    grid_block_add(p->board, &b);
+    grid_clear_lines(p->board);
+
+    for (int i = 0; i < p->n; i++)
+        p->seq[i] = shape_stream_peek(ss, i + 1);
+
+    search_ctx_stop(p->ctx, false);
+    p->found = false;
+    p->running = !pthread_create(&p->thread, NULL, ponder_main, p);
+}
+
+/* Stop the background search, and return its move if it was searching g for
+ * the piece now current.
+ */
+bool ponder_finish(ponder_t *p, const grid_t *g, move_t *m)
+{
+    if (!p->running)
+        return false;
+
+    search_ctx_stop(p->ctx, true);
+    pthread_join(p->thread, NULL);
+    p->running = false;
+
+    if (!p->found || p->board->hash != g->hash)
+        return false;
+    *m = p->move;
+    return true;
+}
+
+/* Add the counters of the background searches to st, stopping a running one */
+void ponder_stats(ponder_t *p, search_stats_t *st)
+{
+    ponder_finish(p, p->board, &p->move);
+    search_ctx_stats(p->ctx, st);
+}
+
+void ponder_free(ponder_t *p)
+{
+    if (!p)
+        return;
+    ponder_finish(p, p->board, &p->move);
+    search_ctx_free(p->ctx);
+    nfree(p);
+}
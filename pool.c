@@ -0,0 +1,193 @@
+/*
+ * A fixed-size thread pool running batches of independent, indexed tasks.
+ *
+ * Every batch is partitioned into one contiguous range of task indices per
+ * worker. A worker takes tasks from the front of its own range, and once the
+ * range is exhausted it steals single tasks from the back of the others.
+ * Each range is packed into one atomic word, so owner and thieves only ever
+ * race through compare-and-swap.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "nalloc.h"
+#include "tetris.h"
+
+#define RANGE(lo, hi) (((uint64_t) (lo) << 32) | (uint32_t) (hi))
+#define RANGE_LO(r) ((int) ((r) >> 32))
+#define RANGE_HI(r) ((int) (uint32_t) (r))
+
+typedef struct {
+    pool_t *pool;
+    int id;
+} worker_t;
+
+struct pool {
+    int n_workers; /* including the thread calling pool_run */
+    pthread_t *threads;
+    worker_t *workers;
+    _Atomic uint64_t *ranges;
+
+    pthread_mutex_t lock;
+    pthread_cond_t start, done;
+    unsigned gen;
+    int n_busy;
+    bool quit;
+
+    pool_fn_t fn;
+    void *arg;
+};
+
+static bool take_front(_Atomic uint64_t *range, int *task)
+{
+    uint64_t r = atomic_load(range);
+    while (RANGE_LO(r) < RANGE_HI(r)) {
+        if (atomic_compare_exchange_weak(range, &r,
+                                         RANGE(RANGE_LO(r) + 1, RANGE_HI(r)))) {
+            *task = RANGE_LO(r);
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool take_back(_Atomic uint64_t *range, int *task)
+{
+    uint64_t r = atomic_load(range);
+    while (RANGE_LO(r) < RANGE_HI(r)) {
+        if (atomic_compare_exchange_weak(range, &r,
+                                         RANGE(RANGE_LO(r), RANGE_HI(r) - 1))) {
+            *task = RANGE_HI(r) - 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void pool_work(pool_t *p, int id)
+{
+    int task;
+    for (;;) {
+        if (take_front(&p->ranges[id], &task)) {
+            SPAN_BEGIN("task");
+            p->fn(p->arg, id, task);
+            SPAN_END();
+            continue;
+        }
+
+        bool stolen = false;
+        for (int i = 1; i < p->n_workers && !stolen; i++)
+            stolen = take_back(&p->ranges[(id + i) % p->n_workers], &task);
+        if (!stolen)
+            return;
+        SPAN_BEGIN("stolen task");
+        p->fn(p->arg, id, task);
+        SPAN_END();
+    }
+}
+
+static void *pool_thread(void *arg)
+{
+    worker_t *w = arg;
+    pool_t *p = w->pool;
+    unsigned seen = 0;
+
+    SPAN_THREAD("pool", w->id);
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (p->gen == seen && !p->quit)
+            pthread_cond_wait(&p->start, &p->lock);
+        if (p->quit)
+            break;
+        seen = p->gen;
+        pthread_mutex_unlock(&p->lock);
+
+        pool_work(p, w->id);
+
+        pthread_mutex_lock(&p->lock);
+        if (--p->n_busy == 0)
+            pthread_cond_signal(&p->done);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+pool_t *pool_new(int n_workers)
+{
+    if (n_workers < 1)
+        n_workers = 1;
+
+    pool_t *p = ncalloc(1, sizeof(*p), NULL);
+    p->n_workers = n_workers;
+    p->threads = ncalloc(n_workers, sizeof(*p->threads), p);
+    p->workers = ncalloc(n_workers, sizeof(*p->workers), p);
+    p->ranges = ncalloc(n_workers, sizeof(*p->ranges), p);
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->start, NULL);
+    pthread_cond_init(&p->done, NULL);
+
+    /* Worker 0 is whoever calls pool_run */
+    for (int i = 0; i < n_workers; i++) {
+        p->workers[i].pool = p;
+        p->workers[i].id = i;
+        if (i)
+            pthread_create(&p->threads[i], NULL, pool_thread, &p->workers[i]);
+    }
+    return p;
+}
+
+int pool_size(const pool_t *p)
+{
+    return p->n_workers;
+}
+
+void pool_run(pool_t *p, int n_tasks, pool_fn_t fn, void *arg)
+{
+    p->fn = fn;
+    p->arg = arg;
+    for (int i = 0; i < p->n_workers; i++) {
+        int lo = (int) ((int64_t) n_tasks * i / p->n_workers);
+        int hi = (int) ((int64_t) n_tasks * (i + 1) / p->n_workers);
+        atomic_store(&p->ranges[i], RANGE(lo, hi));
+    }
+
+    if (p->n_workers == 1) {
+        pool_work(p, 0);
+        return;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->n_busy = p->n_workers - 1;
+    p->gen++;
+    pthread_cond_broadcast(&p->start);
+    pthread_mutex_unlock(&p->lock);
+
+    pool_work(p, 0);
+
+    pthread_mutex_lock(&p->lock);
+    while (p->n_busy)
+        pthread_cond_wait(&p->done, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void pool_free(pool_t *p)
+{
+    if (!p)
+        return;
+
+    pthread_mutex_lock(&p->lock);
+    p->quit = true;
+    pthread_cond_broadcast(&p->start);
+    pthread_mutex_unlock(&p->lock);
+
+    for (int i = 1; i < p->n_workers; i++)
+        pthread_join(p->threads[i], NULL);
+
+    pthread_cond_destroy(&p->done);
+    pthread_cond_destroy(&p->start);
+    pthread_mutex_destroy(&p->lock);
+    nfree(p);
+}
@@ -0,0 +1,154 @@
+/*
+ * Terminal renderer without ncurses: the board is drawn into a back frame
+ * buffer, and each frame sends only the cells that differ from the front
+ * buffer, the frame last shown, as ANSI escape sequences in a single write.
+ * A frame of one dropped piece costs a few dozen bytes, so the board can be
+ * watched at the speed of headless games, over slow links too.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "nalloc.h"
+#include "tetris.h"
+
+#define EDGE 1
+#define STATUS_LEN 80
+
+/* Cell states, also indices of their colors */
+enum { CELL_BLANK, CELL_BLOCK, CELL_BORDER, CELL_UNKNOWN };
+
+struct render {
+    int fd;
+    int rows, cols; /* of the frame, border included */
+    uint8_t *front, *back;
+    char status[STATUS_LEN], shown[STATUS_LEN];
+
+    char *out;
+    size_t out_len;
+
+    /* Terminal state after the bytes queued so far */
+    int cur_r, cur_c, cur_attr;
+};
+
+/* Background colors, two columns per cell to keep them roughly square */
+static const char *const cell_sgr[] = {"\x1b[0m", "\x1b[47m", "\x1b[42m"};
+
+static void out_str(render_t *r, const char *s)
+{
+    size_t n = strlen(s);
+    memcpy(r->out + r->out_len, s, n);
+    r->out_len += n;
+}
+
+/* Position the cursor at frame cell (row, col), 0-based */
+static void out_goto(render_t *r, int row, int col)
+{
+    if (r->cur_r == row && r->cur_c == col)
+        return;
+    r->out_len += sprintf(r->out + r->out_len, "\x1b[%d;%dH", row + 1,
+                          2 * col + 1);
+    r->cur_r = row;
+    r->cur_c = col;
+}
+
+render_t *render_new(int height, int width, int fd)
+{
+    render_t *r = ncalloc(1, sizeof(*r), NULL);
+    r->fd = fd;
+    r->rows = height + 2 * EDGE;
+    r->cols = width + 2 * EDGE;
+
+    int n = r->rows * r->cols;
+    r->front = nalloc(n, r);
+    r->back = nalloc(n, r);
+    memset(r->front, CELL_UNKNOWN, n);
+    for (int row = 0; row < r->rows; row++)
+        for (int col = 0; col < r->cols; col++) {
+            bool edge = row < EDGE || row >= r->rows - EDGE || col < EDGE ||
+                        col >= r->cols - EDGE;
+            r->back[row * r->cols + col] = edge ? CELL_BORDER : CELL_BLANK;
+        }
+
+    /* Worst case: every cell moves the cursor and changes color, plus the
+     * status line and the setup and teardown sequences
+     */
+    r->out = nalloc(n * 24 + 2 * STATUS_LEN + 64, r);
+
+    /* Clear the screen and hide the cursor */
+    out_str(r, "\x1b[0m\x1b[2J\x1b[?25l");
+    r->cur_r = r->cur_c = -1;
+    r->cur_attr = CELL_BLANK;
+    return r;
+}
+
+/* Draw the board into the back buffer */
+void render_grid(render_t *r, const grid_t *g)
+{
+    for (int row = 0; row < g->height; row++) {
+        uint8_t *cell = r->back + (r->rows - EDGE - 1 - row) * r->cols + EDGE;
+        row_t bits = g->rows[row];
+        for (int col = 0; col < g->width; col++)
+            cell[col] = (bits >> col) & 1 ? CELL_BLOCK : CELL_BLANK;
+    }
+}
+
+/* Set the line of text shown below the board */
+void render_status(render_t *r, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(r->status, sizeof(r->status), fmt, ap);
+    va_end(ap);
+}
+
+/* Send the changes since the last frame in one write */
+bool render_flush(render_t *r)
+{
+    SPAN_BEGIN("render");
+    for (int row = 0; row < r->rows; row++) {
+        for (int col = 0; col < r->cols; col++) {
+            int i = row * r->cols + col;
+            if (r->back[i] == r->front[i])
+                continue;
+            out_goto(r, row, col);
+            if (r->cur_attr != r->back[i]) {
+                out_str(r, cell_sgr[r->back[i]]);
+                r->cur_attr = r->back[i];
+            }
+            out_str(r, "  ");
+            r->cur_c++;
+            r->front[i] = r->back[i];
+        }
+    }
+
+    if (strcmp(r->status, r->shown)) {
+        out_goto(r, r->rows, 0);
+        if (r->cur_attr != CELL_BLANK) {
+            out_str(r, cell_sgr[CELL_BLANK]);
+            r->cur_attr = CELL_BLANK;
+        }
+        /* Erase what a longer previous status left past the new one */
+        out_str(r, r->status);
+        out_str(r, "\x1b[K");
+        strcpy(r->shown, r->status);
+        r->cur_r = -1;
+    }
+
+    bool ok = write_all(r->fd, r->out, r->out_len);
+    r->out_len = 0;
+    SPAN_END();
+    return ok;
+}
+
+/* Leave the cursor below the frame, visible again */
+void render_free(render_t *r)
+{
+    if (!r)
+        return;
+    r->out_len += sprintf(r->out + r->out_len, "\x1b[0m\x1b[%d;1H\x1b[?25h",
+                          r->rows + 2);
+    write_all(r->fd, r->out, r->out_len);
+    nfree(r);
+}
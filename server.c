@@ -0,0 +1,367 @@
+/*
+ * Best-move service: answers search requests, one per line, over stdin and
+ * stdout or a TCP connection, with one search context kept warm across them.
+ *
+ *   move ID WIDTH HEIGHT ROWS PIECES [WEIGHTS]
+ *
+ * ROWS lists the rows from the bottom as hex bitmasks, bit c for column c,
+ * comma separated ('-' for an empty board). PIECES lists the indices of the
+ * current piece and the preview in the shape set. WEIGHTS, comma separated
+ * in the order of weights files, override the server's for this request.
+ *
+ *   weights ID WEIGHTS
+ *
+ * replaces the server's weights. Every reply is one line starting with the
+ * ID of its request: "ID ROT COL SCORE", "ID none" when the piece can not be
+ * placed, "ID ok", or "ID error REASON". Requests may be pipelined: they are
+ * answered in order, and replies are flushed whenever no complete request is
+ * waiting, so a batch of requests costs one write.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "nalloc.h"
+#include "tetris.h"
+
+#define SERVER_MAX_PIECES 16
+#define SERVER_BUF (64 * 1024)
+#define SERVER_IDLE_MS 200
+
+typedef struct {
+    search_opts_t opts;
+    float w[EVAL_N_WEIGHTS];
+
+    grid_t *g;
+    search_ctx_t *ctx;
+    int ctx_depth;
+    search_stats_t retired; /* of the contexts replaced so far */
+
+    char in[SERVER_BUF];
+    size_t in_len;
+    char out[SERVER_BUF];
+    size_t out_len;
+} server_t;
+
+static bool server_flush(server_t *s, int fd)
+{
+    bool ok = write_all(fd, s->out, s->out_len);
+    s->out_len = 0;
+    return ok;
+}
+
+/* Queue a reply, flushing the queue first if it does not fit */
+static void server_reply(server_t *s, int fd, const char *fmt, ...)
+{
+    for (int tries = 0; tries < 2; tries++) {
+        size_t room = SERVER_BUF - s->out_len;
+        va_list ap;
+        va_start(ap, fmt);
+        int n = vsnprintf(s->out + s->out_len, room, fmt, ap);
+        va_end(ap);
+        if (n >= 0 && (size_t) n < room) {
+            s->out_len += n;
+            return;
+        }
+        server_flush(s, fd);
+    }
+}
+
+/* Parse up to max comma-separated hex numbers */
+static int parse_rows(char *tok, row_t *rows, int max)
+{
+    if (!strcmp(tok, "-"))
+        return 0;
+
+    int n = 0;
+    for (char *p = tok; *p;) {
+        char *end;
+        unsigned long long v = strtoull(p, &end, 16);
+        if (end == p || n == max)
+            return -1;
+        rows[n++] = v;
+        if (*end == ',')
+            end++;
+        else if (*end)
+            return -1;
+        p = end;
+    }
+    return n;
+}
+
+static int parse_pieces(char *tok, const shape_t **seq, int max)
+{
+    int n = 0;
+    for (char *p = tok; *p;) {
+        char *end;
+        long v = strtol(p, &end, 10);
+        if (end == p || n == max || v < 0 || v >= shapes_count())
+            return -1;
+        seq[n++] = shape_get(v);
+        if (*end == ',')
+            end++;
+        else if (*end)
+            return -1;
+        p = end;
+    }
+    return n;
+}
+
+static bool parse_weights(char *tok, float *w)
+{
+    char *p = tok;
+    for (int i = 0; i < EVAL_N_WEIGHTS; i++) {
+        char *end;
+        w[i] = strtof(p, &end);
+        if (end == p)
+            return false;
+        if (i < EVAL_N_WEIGHTS - 1 && *end++ != ',')
+            return false;
+        p = end;
+    }
+    return !*p;
+}
+
+/* Free the search context, keeping its stats for the dumps */
+static void server_ctx_free(server_t *s)
+{
+    if (!s->ctx)
+        return;
+    search_ctx_stats(s->ctx, &s->retired);
+    search_ctx_free(s->ctx);
+    s->ctx = NULL;
+}
+
+/* Size the board and the search context for a request, keeping both when
+ * they already fit.
+ */
+static void server_prepare(server_t *s, int width, int height, int depth)
+{
+    if (s->g && (s->g->width != width || s->g->height != height)) {
+        nfree(s->g);
+        s->g = NULL;
+        server_ctx_free(s);
+    }
+    if (!s->g)
+        s->g = grid_new(height, width);
+    if (s->ctx && s->ctx_depth < depth)
+        server_ctx_free(s);
+    if (!s->ctx) {
+        s->ctx_depth = depth > s->ctx_depth ? depth : s->ctx_depth;
+        s->ctx = search_ctx_new(height, width, s->ctx_depth, &s->opts);
+    }
+}
+
+static void server_move(server_t *s, int fd, const char *id, char **tok)
+{
+    row_t rows[GRID_MAX_HEIGHT];
+    const shape_t *seq[SERVER_MAX_PIECES];
+    float req_w[EVAL_N_WEIGHTS];
+    float *w = s->w;
+
+    if (!tok[0] || !tok[1] || !tok[2] || !tok[3]) {
+        server_reply(s, fd, "%s error usage: move ID WIDTH HEIGHT ROWS "
+                     "PIECES [WEIGHTS]\n", id);
+        return;
+    }
+    int width = atoi(tok[0]), height = atoi(tok[1]);
+    if (width < 4 || width > GRID_ROW_BITS || height < 4 ||
+        height > GRID_MAX_HEIGHT) {
+        server_reply(s, fd, "%s error unsupported board size\n", id);
+        return;
+    }
+    int n_rows = parse_rows(tok[2], rows, height);
+    /* The search clears at most a piece's worth of rows at once, so a board
+     * must not start with full rows
+     */
+    row_t full = ((row_t) 2 << (width - 1)) - 1;
+    for (int r = 0; r < n_rows; r++) {
+        if ((rows[r] & full) == full) {
+            n_rows = -1;
+            break;
+        }
+    }
+    if (n_rows < 0) {
+        server_reply(s, fd, "%s error bad rows\n", id);
+        return;
+    }
+    int n = parse_pieces(tok[3], seq, SERVER_MAX_PIECES);
+    if (n <= 0) {
+        server_reply(s, fd, "%s error bad pieces\n", id);
+        return;
+    }
+    if (tok[4]) {
+        if (!parse_weights(tok[4], req_w)) {
+            server_reply(s, fd, "%s error bad weights\n", id);
+            return;
+        }
+        w = req_w;
+    }
+
+    server_prepare(s, width, height, n);
+    grid_load_rows(s->g, rows, n_rows);
+    move_t *m = best_move_seq(s->ctx, s->g, seq, n, w);
+    if (m)
+        server_reply(s, fd, "%s %d %d %.6g\n", id, m->rot, m->col,
+                     search_ctx_value(s->ctx));
+    else
+        server_reply(s, fd, "%s none\n", id);
+}
+
+/* Handle one request line, split in place. Return false on quit. */
+static bool server_request(server_t *s, int fd, char *line)
+{
+    char *tok[8] = {NULL};
+    int n_tok = 0;
+    for (char *save, *t = strtok_r(line, " \t\r", &save); t && n_tok < 8;
+         t = strtok_r(NULL, " \t\r", &save))
+        tok[n_tok++] = t;
+    if (!n_tok)
+        return true;
+
+    const char *id = tok[1] ? tok[1] : "?";
+    if (!strcmp(tok[0], "move")) {
+        server_move(s, fd, id, tok + 2);
+    } else if (!strcmp(tok[0], "weights")) {
+        float w[EVAL_N_WEIGHTS];
+        if (tok[2] && parse_weights(tok[2], w)) {
+            memcpy(s->w, w, sizeof(w));
+            server_reply(s, fd, "%s ok\n", id);
+        } else {
+            server_reply(s, fd, "%s error bad weights\n", id);
+        }
+    } else if (!strcmp(tok[0], "quit")) {
+        return false;
+    } else {
+        server_reply(s, fd, "%s error unknown request %s\n", id, tok[0]);
+    }
+    return true;
+}
+
+/* Answer SIGUSR1 with the stats of every search served so far */
+static void server_stats(const server_t *s)
+{
+    if (!stats_requested())
+        return;
+    search_stats_t st = s->retired;
+    if (s->ctx)
+        search_ctx_stats(s->ctx, &st);
+    search_stats_print(stderr, &st);
+}
+
+/* Serve requests from in until it closes or asks to quit */
+static void server_loop(server_t *s, int in, int out)
+{
+    s->in_len = 0;
+    for (bool quit = false; !quit;) {
+        /* Serve every complete line buffered so far */
+        char *start = s->in, *nl;
+        while (!quit && (nl = memchr(start, '\n', s->in + s->in_len - start))) {
+            *nl = '\0';
+            server_stats(s);
+            quit = !server_request(s, out, start);
+            start = nl + 1;
+        }
+        s->in_len -= start - s->in;
+        memmove(s->in, start, s->in_len);
+
+        /* Nothing left to answer before reading again */
+        if (!server_flush(s, out) || quit)
+            break;
+        if (s->in_len == sizeof(s->in)) {
+            server_reply(s, out, "? error request too long\n");
+            s->in_len = 0;
+            continue;
+        }
+
+        /* Wake up now and then while idle, as reads restart after SIGUSR1 */
+        server_stats(s);
+        struct pollfd pfd = {.fd = in, .events = POLLIN};
+        int ready = poll(&pfd, 1, SERVER_IDLE_MS);
+        if (ready < 0 && errno != EINTR)
+            break;
+        if (ready <= 0)
+            continue;
+        ssize_t n = read(in, s->in + s->in_len, sizeof(s->in) - s->in_len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        s->in_len += n;
+    }
+    server_flush(s, out);
+}
+
+static server_t *server_new(const float *w, const search_opts_t *opts)
+{
+    server_t *s = ncalloc(1, sizeof(*s), NULL);
+    s->opts = *opts;
+    s->ctx_depth = opts->preview > 0 ? opts->preview : SS_DEFAULT_LEN;
+    memcpy(s->w, w, sizeof(s->w));
+    return s;
+}
+
+static void server_free(server_t *s)
+{
+    server_ctx_free(s);
+    nfree(s->g);
+    nfree(s);
+}
+
+void serve_stdio(const float *w, const search_opts_t *opts)
+{
+    server_t *s = server_new(w, opts);
+    server_loop(s, STDIN_FILENO, STDOUT_FILENO);
+    server_free(s);
+}
+
+/* Serve the clients connecting to port on the loopback interface, one at a
+ * time, sharing one warm search context.
+ */
+bool serve_tcp(const float *w, const search_opts_t *opts, int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return false;
+    /* A client going away must not kill the server */
+    signal(SIGPIPE, SIG_IGN);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(fd, 8) < 0) {
+        close(fd);
+        return false;
+    }
+
+    server_t *s = server_new(w, opts);
+    for (;;) {
+        int c = accept(fd, NULL, NULL);
+        if (c < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        setsockopt(c, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        server_loop(s, c, c);
+        close(c);
+    }
+    server_free(s);
+    close(fd);
+    return true;
+}
@@ -6,15 +6,19 @@
 #include "nalloc.h"
 #include "tetris.h"
 
+#ifndef DATADIR
+#define DATADIR "data"
+#endif
+
 static int cmp_coord(const void *a, const void *b)
 {
-    int *A = *((int **) a), *B = *((int **) b);
+    const int8_t *A = a, *B = b;
     if (A[1] != B[1])
-        return -(B[1] - A[1]);
+        return A[1] - B[1];
     return A[0] - B[0];
 }
 
-static int max_dim(int **coords, int count, int dim)
+static int max_dim(int8_t coords[][2], int count, int dim)
 {
     int mx = coords[0][dim];
     for (int i = 1; i < count; i++) {
@@ -25,7 +29,7 @@ static int max_dim(int **coords, int count, int dim)
     return mx;
 }
 
-static int min_dim(int **coords, int count, int dim)
+static int min_dim(int8_t coords[][2], int count, int dim)
 {
     int mn = coords[0][dim];
     for (int i = 1; i < count; i++) {
@@ -41,64 +45,83 @@ static inline int max_ab(int a, int b)
     return a > b ? a : b;
 }
 
-static shape_t *shape_new(int **shape_rot)
+static void normalize(int8_t coords[][2], int count)
 {
-    /* shape_rot is one rotation of the shape */
-    shape_t *s = nalloc(sizeof(shape_t), shape_rot);
+    int extreme_left = min_dim(coords, count, 0);
+    int extreme_bot = min_dim(coords, count, 1);
+    for (int i = 0; i < count; i++) {
+        coords[i][0] -= extreme_left;
+        coords[i][1] -= extreme_bot;
+    }
+}
 
-    /* Normalize to (0, 0) */
-    int extreme_left = min_dim(shape_rot, 4, 0);
-    int extreme_bot = min_dim(shape_rot, 4, 1);
+/* Lay out every (rotation, column) of s up to the widest board supported */
+static void shape_place_init(shape_t *s, void *parent)
+{
+    int n = 0;
+    for (int r = 0; r < s->n_rot; r++)
+        n += GRID_ROW_BITS - s->rot_wh[r].x + 1;
 
-    /* Define all rotations */
-    s->rot[0] = ncalloc(4, sizeof(*s->rot[0]), s);
+    placement_t *p = ncalloc(n, sizeof(*p), parent);
+    for (int r = 0; r < s->n_rot; r++) {
+        s->place[r] = p;
+        for (int c = 0; c + s->rot_wh[r].x <= GRID_ROW_BITS; c++, p++) {
+            p->rot = r;
+            p->col = c;
+            p->height = s->rot_wh[r].y;
+            for (int i = 0; i < MAX_BLOCK_LEN; i++) {
+                p->mask[i] = (row_t) (s->rot_mask[r][i] << c);
+                p->cells[i][0] = s->rot_flat[r][i][0] + c;
+                p->cells[i][1] = s->rot_flat[r][i][1];
+            }
+            p->n_crust = s->crust_len[r][BOT];
+            for (int i = 0; i < p->n_crust; i++) {
+                p->crust[i][0] = s->crust_flat[r][BOT][i][0] + c;
+                p->crust[i][1] = s->crust_flat[r][BOT][i][1];
+            }
+        }
+    }
+}
+
+/* Build s from one rotation of the shape. Placements are allocated under
+ * parent.
+ */
+static void shape_init(shape_t *s, const int cells[MAX_BLOCK_LEN][2],
+                       void *parent)
+{
+    memset(s, 0, sizeof(*s));
 
     /* First rotation: normalize to (0, 0) */
-    for (int i = 0; i < 4; i++) {
-        s->rot[0][i] = ncalloc(2, sizeof(*s->rot[0][i]), s->rot[0]);
-        s->rot[0][i][0] = shape_rot[i][0] - extreme_left;
-        s->rot[0][i][1] = shape_rot[i][1] - extreme_bot;
+    int8_t(*rot)[MAX_BLOCK_LEN][2] = s->rot_flat;
+    for (int i = 0; i < MAX_BLOCK_LEN; i++) {
+        rot[0][i][0] = cells[i][0];
+        rot[0][i][1] = cells[i][1];
     }
-    s->max_dim_len =
-        max_ab(max_dim(s->rot[0], 4, 0), max_dim(s->rot[0], 4, 1)) + 1;
+    normalize(rot[0], MAX_BLOCK_LEN);
+    s->max_dim_len = max_ab(max_dim(rot[0], MAX_BLOCK_LEN, 0),
+                            max_dim(rot[0], MAX_BLOCK_LEN, 1)) +
+                     1;
 
-    /* Define 1-4 rotations */
+    /* Define 1-4 rotations, normalized to detect uniqueness later */
     for (int roti = 1; roti < 4; roti++) {
-        s->rot[roti] = ncalloc(4, sizeof(*s->rot[roti]), s);
-        for (int i = 0; i < 4; i++) {
-            s->rot[roti][i] =
-                ncalloc(2, sizeof(*s->rot[roti][i]), s->rot[roti]);
-            s->rot[roti][i][0] = s->rot[roti - 1][i][1];
-            s->rot[roti][i][1] = s->max_dim_len - 1 - s->rot[roti - 1][i][0];
-        }
-
-        /* Need to normalize to detect uniqueness later */
-        extreme_left = min_dim(s->rot[roti], 4, 0);
-        extreme_bot = min_dim(s->rot[roti], 4, 1);
-        for (int i = 0; i < 4; i++) {
-            s->rot[roti][i][0] -= extreme_left;
-            s->rot[roti][i][1] -= extreme_bot;
+        for (int i = 0; i < MAX_BLOCK_LEN; i++) {
+            rot[roti][i][0] = rot[roti - 1][i][1];
+            rot[roti][i][1] = s->max_dim_len - 1 - rot[roti - 1][i][0];
         }
+        normalize(rot[roti], MAX_BLOCK_LEN);
     }
 
-    /* Initialize s->rot_wh */
     for (int roti = 0; roti < 4; roti++) {
-        s->rot_wh[roti].x = max_dim(s->rot[roti], 4, 0) + 1;
-        s->rot_wh[roti].y = max_dim(s->rot[roti], 4, 1) + 1;
+        s->rot_wh[roti].x = max_dim(rot[roti], MAX_BLOCK_LEN, 0) + 1;
+        s->rot_wh[roti].y = max_dim(rot[roti], MAX_BLOCK_LEN, 1) + 1;
     }
 
     /* Determine number of unique rotations */
-    char rot_str[4][4 * 2 + 1];
     s->n_rot = 0;
     for (int roti = 0; roti < 4; roti++) {
-        rot_str[roti][4 * 2] = '\0';
-        qsort(s->rot[roti], 4, sizeof(int) * 2, cmp_coord);
-        for (int i = 0; i < 4; i++) {
-            rot_str[roti][2 * i] = '0' + s->rot[roti][i][0];
-            rot_str[roti][2 * i + 1] = '0' + s->rot[roti][i][1];
-        }
+        qsort(rot[roti], MAX_BLOCK_LEN, sizeof(rot[roti][0]), cmp_coord);
         for (int i = 0; i < roti; i++) {
-            if (!strcmp(rot_str[i], rot_str[roti]))
+            if (!memcmp(rot[i], rot[roti], sizeof(rot[roti])))
                 goto setup;
         }
         s->n_rot++;
@@ -115,71 +138,64 @@ setup:
             for (int i = 0; i < s->max_dim_len; i++)
                 extremes[i][0] = -1;
 
-            int crust_len = 0;
-            for (int i = 0; i < 4; i++) {
-                int key = s->rot[roti][i][(dim + 1) % 2];
-                int val = s->rot[roti][i][dim];
+            for (int i = 0; i < MAX_BLOCK_LEN; i++) {
+                int key = rot[roti][i][(dim + 1) % 2];
+                int val = rot[roti][i][dim];
                 int curr = extremes[key][0];
                 bool replace = curr == -1 || (keep_max && val > curr) ||
                                (!keep_max && val < curr);
-                if (curr == -1)
-                    crust_len++;
-
                 if (replace) {
                     extremes[key][0] = val;
                     extremes[key][1] = i;
                 }
             }
-            s->crust_len[roti][d] = crust_len;
-            s->crust[roti][d] = ncalloc(crust_len, sizeof(*s->crust[roti]), s);
-            int ii = 0;
+
+            int8_t(*crust)[2] = s->crust_flat[roti][d];
+            int crust_len = 0;
             for (int i = 0; i < s->max_dim_len; i++) {
                 if (extremes[i][0] != -1) {
                     int index = extremes[i][1];
-                    s->crust[roti][d][ii] = ncalloc(
-                        2, sizeof(*s->crust[roti][i]), s->crust[roti][d]);
-                    s->crust[roti][d][ii][0] = s->rot[roti][index][0];
-                    s->crust[roti][d][ii][1] = s->rot[roti][index][1];
-                    ii++;
+                    crust[crust_len][0] = rot[roti][index][0];
+                    crust[crust_len][1] = rot[roti][index][1];
+                    crust_len++;
                 }
             }
-            qsort(s->crust[roti][d], crust_len, sizeof(int) * 2, cmp_coord);
+            qsort(crust, crust_len, sizeof(crust[0]), cmp_coord);
+            s->crust_len[roti][d] = crust_len;
         }
     }
 
-    /* Initialize the flat, more efficient versions */
     for (int r = 0; r < s->n_rot; r++) {
-        for (int dim = 0; dim < 2; dim++) {
-            for (int i = 0; i < MAX_BLOCK_LEN; i++)
-                s->rot_flat[r][i][dim] = s->rot[r][i][dim];
-            for (direction_t d = 0; d < 4; d++) {
-                for (int i = 0; i < s->crust_len[r][d]; i++)
-                    s->crust_flat[d][r][i][dim] = s->crust[d][r][i][dim];
-            }
-        }
+        for (int i = 0; i < MAX_BLOCK_LEN; i++)
+            s->rot_mask[r][rot[r][i][1]] |= (row_t) 1 << rot[r][i][0];
     }
-    return s;
+    shape_place_init(s, parent);
 }
 
-static shape_t **shapes_read(const char *file, int *count)
+static shape_t *shapes_read(const char *file, int *count)
 {
     FILE *fh = fopen(file, "r");
     if (!fh)
         return NULL;
 
     *count = 0;
-    shape_t **s = nalloc(sizeof(shape_t *), NULL);
-    while (!feof(fh)) {
-        int **rot = ncalloc(4, sizeof(*rot), s);
-        for (int i = 0; i < 4; i++) {
-            rot[i] = ncalloc(2, sizeof(*rot[i]), rot);
-            if (!fscanf(fh, "%d", &rot[i][0]))
-                return NULL;
-            if (!fscanf(fh, "%d", &rot[i][1]))
-                return NULL;
+    /* All shapes and their placements live in one region */
+    shape_t *s = nalloc_region(sizeof(*s), NULL);
+    for (;;) {
+        int cells[MAX_BLOCK_LEN][2];
+        int n = 0;
+        while (n < MAX_BLOCK_LEN &&
+               fscanf(fh, "%d %d", &cells[n][0], &cells[n][1]) == 2)
+            n++;
+        if (!n && feof(fh))
+            break;
+        if (n < MAX_BLOCK_LEN) {
+            fclose(fh);
+            nfree(s);
+            return NULL;
         }
-        s = nrealloc(s, (*count + 1) * sizeof(shape_t *));
-        s[(*count)++] = shape_new(rot);
+        s = nrealloc(s, (*count + 1) * sizeof(*s));
+        shape_init(&s[(*count)++], cells, s);
     }
 
     fclose(fh);
@@ -187,12 +203,39 @@ static shape_t **shapes_read(const char *file, int *count)
     return s;
 }
 
+#ifdef BUILTIN_SHAPES
+#include "shapes.inc"
+#endif
+
 static int n_shapes;
-static shape_t **shapes;
+static const shape_t *shapes;
+static shape_t *shapes_loaded;
 
-bool shapes_init(char *shapes_file)
+bool shapes_init(const char *shapes_file)
 {
-    return (bool) (shapes = shapes_read(shapes_file, &n_shapes));
+#ifdef BUILTIN_SHAPES
+    if (!shapes_file) {
+        shapes = builtin_shapes;
+        n_shapes = sizeof(builtin_shapes) / sizeof(builtin_shapes[0]);
+        return true;
+    }
+#else
+    if (!shapes_file)
+        shapes_file = DATADIR "/shapes";
+#endif
+    shapes_loaded = shapes_read(shapes_file, &n_shapes);
+    shapes = shapes_loaded;
+    return shapes;
+}
+
+int shapes_count(void)
+{
+    return n_shapes;
+}
+
+const shape_t *shape_get(int idx)
+{
+    return &shapes[idx];
 }
 
 static inline uint32_t __umulhi(uint32_t a, uint32_t b)
@@ -201,21 +244,51 @@ static inline uint32_t __umulhi(uint32_t a, uint32_t b)
     return (uint32_t) (c >> 32);
 }
 
+static inline uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* Nearby seeds are spread by splitmix64, so seed and seed + 1 give unrelated
+ * streams.
+ */
+void rng_seed(rng_t *r, uint64_t seed)
+{
+    r->state = 0;
+    r->inc = splitmix64(&seed) << 1 | 1;
+    rng_next(r);
+    r->state += splitmix64(&seed);
+    rng_next(r);
+}
+
+/* See https://www.pcg-random.org/ */
+uint32_t rng_next(rng_t *r)
+{
+    uint64_t old = r->state;
+    r->state = old * 6364136223846793005ULL + r->inc;
+    uint32_t xorshifted = ((old >> 18) ^ old) >> 27;
+    uint32_t rot = old >> 59;
+    return (xorshifted >> rot) | (xorshifted << (-rot & 31));
+}
+
 /* Return value in [0,s)
  * See https://lemire.me/blog/2018/12/21/fast-bounded-random-numbers-on-gpus/
  *
- * We should avoid using "rand() % s", which will generate lower numbers more
- * often than higher ones -- it's not a uniform distribution.
+ * We should avoid using "rng_next(r) % s", which will generate lower numbers
+ * more often than higher ones -- it's not a uniform distribution.
  */
-static uint32_t ranged_rand(uint32_t s)
+uint32_t rng_range(rng_t *r, uint32_t s)
 {
-    uint32_t x = rand();
+    uint32_t x = rng_next(r);
     uint32_t h = __umulhi(x, s);
     uint32_t l = x * s;
     if (l < s) {
         uint32_t floor = (UINT32_MAX - s + 1) % s;
         while (l < floor) {
-            x = rand();
+            x = rng_next(r);
             h = __umulhi(x, s);
             l = x * s;
         }
@@ -223,21 +296,38 @@ static uint32_t ranged_rand(uint32_t s)
     return h;
 }
 
-/* FIXME: Can we eliminate? */
-#define SS_MAX_LEN 3
-
-shape_stream_t *shape_stream_new()
+shape_stream_t *shape_stream_new(int max_len, uint64_t seed, bool bag)
 {
     shape_stream_t *s = nalloc(sizeof(*s), NULL);
-    s->max_len = SS_MAX_LEN;
+    s->max_len = max_len > 0 ? max_len : SS_DEFAULT_LEN;
     s->iter = 0;
     s->defined = ncalloc(s->max_len, sizeof(*s->defined), s);
     memset(s->defined, false, s->max_len * sizeof(*s->defined));
     s->stream = ncalloc(s->max_len, sizeof(*s->stream), s);
+
+    rng_seed(&s->rng, seed);
+    s->bag = bag ? ncalloc(n_shapes, sizeof(*s->bag), s) : NULL;
+    s->bag_left = 0;
     return s;
 }
 
-static shape_t *shape_stream_access(shape_stream_t *stream, int idx)
+static const shape_t *shape_stream_draw(shape_stream_t *stream)
+{
+    if (!stream->bag)
+        return &shapes[rng_range(&stream->rng, n_shapes)];
+
+    if (!stream->bag_left) {
+        for (int i = 0; i < n_shapes; i++)
+            stream->bag[i] = i;
+        stream->bag_left = n_shapes;
+    }
+    int i = rng_range(&stream->rng, stream->bag_left);
+    int idx = stream->bag[i];
+    stream->bag[i] = stream->bag[--stream->bag_left];
+    return &shapes[idx];
+}
+
+static const shape_t *shape_stream_access(shape_stream_t *stream, int idx)
 {
     bool pop = false;
     if (idx == -1) {
@@ -246,7 +336,7 @@ static shape_t *shape_stream_access(shape_stream_t *stream, int idx)
     }
     int i = (stream->iter + idx) % stream->max_len;
     if (!stream->defined[i]) {
-        stream->stream[i] = shapes[ranged_rand(n_shapes)];
+        stream->stream[i] = shape_stream_draw(stream);
         stream->defined[i] = true;
     }
     if (pop) {
@@ -256,17 +346,19 @@ static shape_t *shape_stream_access(shape_stream_t *stream, int idx)
     return stream->stream[i];
 }
 
-shape_t *shape_stream_peek(shape_stream_t *stream, int idx)
+const shape_t *shape_stream_peek(shape_stream_t *stream, int idx)
 {
     return shape_stream_access(stream, idx);
 }
 
-shape_t *shape_stream_pop(shape_stream_t *stream)
+const shape_t *shape_stream_pop(shape_stream_t *stream)
 {
     return shape_stream_access(stream, -1);
 }
 
 void free_shape(void)
 {
-    nfree(shapes);
+    nfree(shapes_loaded);
+    shapes_loaded = NULL;
+    shapes = NULL;
 }
\ No newline at end of file
@@ -0,0 +1,197 @@
+/*
+ * Timeline spans, built with -DSEARCH_SPANS=1 (make SPANS=1): every thread
+ * records the spans it completes into its own ring buffer, without locks,
+ * keeping the latest SPAN_RING of them. The ring of a thread that exits is
+ * handed over to the next thread of the same name, so threads started over
+ * and over, like the ponder thread, share one. spans_write dumps all rings as
+ * Chrome trace-event JSON, for chrome://tracing or Perfetto, once the
+ * threads are done. Where <sys/sdt.h> is available, every span also fires
+ * the USDT probes tetris:span_begin and tetris:span_end for perf and
+ * bpftrace.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "nalloc.h"
+#include "tetris.h"
+
+#if SEARCH_SPANS
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define SPAN_PROBE(probe, name) DTRACE_PROBE1(tetris, probe, name)
+#endif
+#endif
+#ifndef SPAN_PROBE
+#define SPAN_PROBE(probe, name) ((void) 0)
+#endif
+
+#define SPAN_RING (1 << 16)
+#define SPAN_STACK 32
+
+typedef struct {
+    const char *name;
+    int64_t start, dur; /* ns */
+} span_t;
+
+typedef struct span_ring {
+    struct span_ring *next;
+    int tid;
+    char name[32];
+    bool idle;  /* its thread exited */
+    uint64_t n; /* spans ever completed, the ring keeps the last SPAN_RING */
+    int depth;  /* of open spans, those past SPAN_STACK are not recorded */
+    const char *open_name[SPAN_STACK];
+    int64_t open_start[SPAN_STACK];
+    span_t spans[SPAN_RING];
+} span_ring_t;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static span_ring_t *rings;
+static int n_rings;
+static _Thread_local span_ring_t *ring;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static int64_t span_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Runs as a thread exits, leaving its ring to a later thread */
+static void span_ring_release(void *arg)
+{
+    span_ring_t *r = arg;
+    pthread_mutex_lock(&rings_lock);
+    r->depth = 0;
+    r->idle = true;
+    pthread_mutex_unlock(&rings_lock);
+}
+
+static void span_key_init(void)
+{
+    pthread_key_create(&ring_key, span_ring_release);
+}
+
+/* This thread's ring, registered on first use: an idle ring of the given
+ * name, or a new one. Rings live until exit, NULL if out of memory.
+ */
+static span_ring_t *span_ring(const char *name)
+{
+    if (ring)
+        return ring;
+    pthread_once(&ring_key_once, span_key_init);
+
+    pthread_mutex_lock(&rings_lock);
+    span_ring_t *r = rings;
+    while (r && !(name && r->idle && !strcmp(r->name, name)))
+        r = r->next;
+    if (r) {
+        r->idle = false;
+    } else if ((r = ncalloc(1, sizeof(*r), NULL))) {
+        r->tid = ++n_rings;
+        snprintf(r->name, sizeof(r->name), r->tid == 1 ? "main" : "thread %d",
+                 r->tid);
+        r->next = rings;
+        rings = r;
+    }
+    pthread_mutex_unlock(&rings_lock);
+
+    if (r)
+        pthread_setspecific(ring_key, r);
+    return ring = r;
+}
+
+void span_thread(const char *name, int id)
+{
+    char buf[sizeof(ring->name)];
+    snprintf(buf, sizeof(buf), "%s %d", name, id);
+    span_ring_t *r = span_ring(buf);
+    if (r)
+        strcpy(r->name, buf);
+}
+
+void span_begin(const char *name)
+{
+    SPAN_PROBE(span_begin, name);
+    span_ring_t *r = span_ring(NULL);
+    if (!r)
+        return;
+    if (r->depth < SPAN_STACK) {
+        r->open_name[r->depth] = name;
+        r->open_start[r->depth] = span_now();
+    }
+    r->depth++;
+}
+
+void span_end(void)
+{
+    span_ring_t *r = ring;
+    if (!r || !r->depth)
+        return;
+    int d = --r->depth;
+    if (d >= SPAN_STACK)
+        return;
+    SPAN_PROBE(span_end, r->open_name[d]);
+    span_t *s = &r->spans[r->n++ % SPAN_RING];
+    s->name = r->open_name[d];
+    s->start = r->open_start[d];
+    s->dur = span_now() - s->start;
+}
+
+/* Dump every ring as trace events, in microseconds. Spans still recording
+ * on other threads may come out torn, so call it once they are done.
+ */
+bool spans_write(const char *path)
+{
+    FILE *f = fopen(path, "w");
+    if (!f)
+        return false;
+
+    pthread_mutex_lock(&rings_lock);
+    int64_t t0 = INT64_MAX;
+    for (span_ring_t *r = rings; r; r = r->next) {
+        uint64_t first = r->n > SPAN_RING ? r->n - SPAN_RING : 0;
+        for (uint64_t i = first; i < r->n; i++) {
+            int64_t t = r->spans[i % SPAN_RING].start;
+            t0 = t < t0 ? t : t0;
+        }
+    }
+
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    bool comma = false;
+    for (span_ring_t *r = rings; r; r = r->next) {
+        fprintf(f,
+                "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,"
+                "\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                comma ? ",\n" : "", r->tid, r->name);
+        comma = true;
+        uint64_t first = r->n > SPAN_RING ? r->n - SPAN_RING : 0;
+        for (uint64_t i = first; i < r->n; i++) {
+            const span_t *s = &r->spans[i % SPAN_RING];
+            fprintf(f,
+                    ",\n{\"ph\":\"X\",\"name\":\"%s\",\"pid\":1,\"tid\":%d,"
+                    "\"ts\":%.3f,\"dur\":%.3f}",
+                    s->name, r->tid, (s->start - t0) / 1e3, s->dur / 1e3);
+        }
+    }
+    fprintf(f, "\n]}\n");
+    pthread_mutex_unlock(&rings_lock);
+    return !fclose(f);
+}
+
+#else
+
+bool spans_write(const char *path)
+{
+    (void) path;
+    return false;
+}
+
+#endif
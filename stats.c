@@ -0,0 +1,150 @@
+/*
+ * Search statistics: merging the counters of several searches, the per-move
+ * time histogram, and the report.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+
+#include "tetris.h"
+
+void search_stats_merge(search_stats_t *dst, const search_stats_t *src)
+{
+    for (int i = 0; i < STATS_DEPTHS; i++)
+        dst->nodes[i] += src->nodes[i];
+    dst->leaves += src->leaves;
+    dst->grid_cpys += src->grid_cpys;
+    dst->clears += src->clears;
+    dst->intersect_tests += src->intersect_tests;
+    dst->nocheck_skips += src->nocheck_skips;
+    dst->drops += src->drops;
+    dst->drop_hits += src->drop_hits;
+    dst->tt_probes += src->tt_probes;
+    dst->tt_hits += src->tt_hits;
+    dst->tt_stores += src->tt_stores;
+    dst->tt_overwrites += src->tt_overwrites;
+    dst->prune_evals += src->prune_evals;
+    dst->prune_cuts += src->prune_cuts;
+    dst->prune_checks += src->prune_checks;
+    dst->prune_agree += src->prune_agree;
+    dst->expect_nodes += src->expect_nodes;
+    dst->expect_hits += src->expect_hits;
+    dst->expect_cutoffs += src->expect_cutoffs;
+    dst->n_moves += src->n_moves;
+    dst->move_ns += src->move_ns;
+    if (src->move_ns_max > dst->move_ns_max)
+        dst->move_ns_max = src->move_ns_max;
+    for (int i = 0; i < STATS_TIME_BUCKETS; i++)
+        dst->move_hist[i] += src->move_hist[i];
+}
+
+/* Account one best_move call of ns nanoseconds */
+void search_stats_move(search_stats_t *st, int64_t ns)
+{
+    uint64_t us = ns / 1000;
+    int bucket = us ? 63 - __builtin_clzll(us) : 0;
+    if (bucket >= STATS_TIME_BUCKETS)
+        bucket = STATS_TIME_BUCKETS - 1;
+
+    st->n_moves++;
+    st->move_ns += ns;
+    if ((uint64_t) ns > st->move_ns_max)
+        st->move_ns_max = ns;
+    st->move_hist[bucket]++;
+}
+
+#define LLU(x) ((unsigned long long) (x))
+
+void search_stats_print(FILE *f, const search_stats_t *st)
+{
+    if (!SEARCH_STATS) {
+        fprintf(f, "stats: compiled out\n");
+        return;
+    }
+    if (!st->n_moves)
+        return;
+
+    fprintf(f, "search: moves %llu time %.3fs avg %.3fms max %.3fms\n",
+            LLU(st->n_moves), st->move_ns * 1e-9,
+            st->move_ns * 1e-6 / st->n_moves, st->move_ns_max * 1e-6);
+
+    fprintf(f, "nodes:");
+    int deepest = STATS_DEPTHS - 1;
+    while (deepest > 0 && !st->nodes[deepest])
+        deepest--;
+    for (int i = 0; i <= deepest; i++)
+        fprintf(f, " d%d %llu", i, LLU(st->nodes[i]));
+    fprintf(f, " leaves %llu\n", LLU(st->leaves));
+
+    uint64_t placements = st->intersect_tests + st->nocheck_skips;
+    fprintf(f,
+            "grid: cpys %llu clears %llu intersect tests %llu skipped %llu "
+            "(%.1f%%) drops %llu cached %llu (%.1f%%)\n",
+            LLU(st->grid_cpys), LLU(st->clears), LLU(st->intersect_tests),
+            LLU(st->nocheck_skips),
+            placements ? 100.0 * st->nocheck_skips / placements : 0,
+            LLU(st->drops), LLU(st->drop_hits),
+            st->drops ? 100.0 * st->drop_hits / st->drops : 0);
+
+    if (st->tt_probes) {
+        fprintf(f,
+                "tt: probes %llu hits %llu (%.1f%%) stores %llu overwrites "
+                "%llu\n",
+                LLU(st->tt_probes), LLU(st->tt_hits),
+                100.0 * st->tt_hits / st->tt_probes, LLU(st->tt_stores),
+                LLU(st->tt_overwrites));
+    }
+
+    if (st->prune_evals) {
+        fprintf(f, "prune: evals %llu cut %llu (%.1f%%)", LLU(st->prune_evals),
+                LLU(st->prune_cuts), 100.0 * st->prune_cuts / st->prune_evals);
+        if (st->prune_checks)
+            fprintf(f, " exhaustive agrees %llu/%llu (%.1f%%)",
+                    LLU(st->prune_agree), LLU(st->prune_checks),
+                    100.0 * st->prune_agree / st->prune_checks);
+        fprintf(f, "\n");
+    }
+
+    if (st->expect_nodes || st->expect_cutoffs) {
+        fprintf(f, "expect: chance nodes %llu cached %llu (%.1f%%) over budget "
+                "%llu\n",
+                LLU(st->expect_nodes), LLU(st->expect_hits),
+                st->expect_nodes ? 100.0 * st->expect_hits / st->expect_nodes
+                                 : 0,
+                LLU(st->expect_cutoffs));
+    }
+
+    /* Bucket i holds moves of [2^i, 2^(i+1)) us, the first one also < 1 us */
+    fprintf(f, "time/move:");
+    for (int i = 0; i < STATS_TIME_BUCKETS; i++) {
+        if (st->move_hist[i])
+            fprintf(f, " <%lluus %llu", LLU(1) << (i + 1),
+                    LLU(st->move_hist[i]));
+    }
+    fprintf(f, "\n");
+}
+
+static volatile sig_atomic_t dump_requested;
+
+static void on_sigusr1(int sig)
+{
+    (void) sig;
+    dump_requested = 1;
+}
+
+void stats_signal_init(void)
+{
+    struct sigaction sa = {.sa_handler = on_sigusr1};
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+}
+
+/* Whether a dump was asked for since the last call */
+bool stats_requested(void)
+{
+    if (!dump_requested)
+        return false;
+    dump_requested = 0;
+    return true;
+}
@@ -0,0 +1,11 @@
+#!/bin/sh
+# The fast paths agree with their plain versions on the board corpus
+
+BENCH=${BENCH:-./tetris-bench}
+
+out=$($BENCH --check) || {
+    echo "check: self-checks failed:"
+    echo "$out"
+    exit 1
+}
+echo "check: ok"
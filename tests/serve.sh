@@ -0,0 +1,23 @@
+#!/bin/sh
+# Malformed requests get an error reply and leave the service running
+
+set -e
+TETRIS=${TETRIS:-./tetris}
+
+out=$(printf '%s\n' \
+    'move 1 14 20 3fff,3fff,3fff,3fff,3fff 0' \
+    'move 2 14 20 1,3fff 0' \
+    'move 3 14 20 1ffe,3 0,1,2' |
+    $TETRIS --serve)
+
+expect() {
+    echo "$out" | grep -q "$1" || {
+        echo "serve: no reply matching '$1' in:"
+        echo "$out"
+        exit 1
+    }
+}
+expect '^1 error bad rows$'
+expect '^2 error bad rows$'
+expect '^3 [0-9]* [0-9]* '
+echo "serve: ok"
@@ -1,7 +1,9 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 typedef enum { BOT, LEFT, TOP, RIGHT } direction_t;
 
@@ -12,52 +14,114 @@ typedef struct {
 /* The max len of any blocks read at runtime */
 #define MAX_BLOCK_LEN 4
 
+/* Grid rows are bitboards: bit c of a row is set when column c is occupied.
+ * Build with -DGRID_ROW_BITS=32 or 64 to support wider boards.
+ */
+#ifndef GRID_ROW_BITS
+#define GRID_ROW_BITS 16
+#endif
+
+#if GRID_ROW_BITS == 16
+typedef uint16_t row_t;
+#elif GRID_ROW_BITS == 32
+typedef uint32_t row_t;
+#elif GRID_ROW_BITS == 64
+typedef uint64_t row_t;
+#else
+#error "GRID_ROW_BITS must be 16, 32 or 64"
+#endif
+
+/* One rotation of a shape at one column: everything needed to drop and place
+ * it, independent of the board. Columns are absolute, rows are relative to the
+ * bottom of the block.
+ */
+typedef struct {
+    row_t mask[MAX_BLOCK_LEN];      // row masks, shifted to the column
+    int8_t cells[MAX_BLOCK_LEN][2]; // blocki, rc
+    int8_t crust[MAX_BLOCK_LEN][2]; // bottom crust, rc
+    uint8_t n_crust;
+    uint8_t rot, col;
+    uint8_t height; /* rows spanned, the top extent is height - 1 */
+} placement_t;
+
+/* Shapes hold no pointers but into their placement tables, so the standard
+ * set can be generated at build time into a static const table.
+ */
 typedef struct {
     int n_rot;
     coord_t rot_wh[4];
-    int **crust[4][4];
-    int crust_len[4][4];
-    int crust_flat[4][4][MAX_BLOCK_LEN][2];  // direction, rotation, blocki, rc
+    uint8_t crust_len[4][4];
+    int8_t crust_flat[4][4][MAX_BLOCK_LEN][2]; // rotation, direction, blocki, rc
     int max_dim_len;
-    int **rot[4];
-    int rot_flat[4][MAX_BLOCK_LEN][2];  // rotation, blocki, rc
+    int8_t rot_flat[4][MAX_BLOCK_LEN][2]; // rotation, blocki, rc
+    row_t rot_mask[4][MAX_BLOCK_LEN];     // rotation, row from the bottom
+
+    /* Per rotation, the placements at columns 0 .. GRID_ROW_BITS - width.
+     * All rotations share one contiguous array.
+     */
+    const placement_t *place[4];
 } shape_t;
 
-bool shapes_init(char *shapes_file);
+/* Load shapes from shapes_file, or take the built-in set if it is NULL */
+bool shapes_init(const char *shapes_file);
+int shapes_count(void);
+const shape_t *shape_get(int idx);
 
 typedef struct {
     coord_t offset;
     int rot;
-    shape_t *shape;
+    const shape_t *shape;
 } block_t;
 
 block_t *block_new(void);
-void block_init(block_t *b, shape_t *s);
+void block_init(block_t *b, const shape_t *s);
 void block_get(block_t *b, int i, coord_t *result);
 void block_rotate(block_t *b, int amount);
 void block_move(block_t *b, direction_t d, int amount);
 int block_extreme(const block_t *b, direction_t d);
 
 typedef struct {
-    shape_t *shape;
+    const shape_t *shape;
     int rot;
     int col;
 } move_t;
 
+/* Column-major occupancy: bit r of a column is set when row r is occupied.
+ * It bounds grids to 64 rows.
+ */
+typedef uint64_t col_t;
+#define GRID_MAX_HEIGHT 64
+
 typedef struct {
-    bool **rows;
-    int **stacks;
-    int *stack_cnt;
+    row_t *rows;
+    row_t full_mask;
+    col_t *cols;
     int *relief;
-    int *n_row_fill;
     int *full_rows;
     int n_full_rows;
     int width, height;
 
     int n_total_cleared, n_last_cleared;
     int *gaps;
+
+    uint64_t hash; /* Zobrist hash of the occupied cells */
+
+    /* Evaluation features, maintained along with relief and gaps */
+    int relief_sum, relief_sq_sum;
+    int relief_max;
+    int *relief_cnt; /* number of columns per relief, offset by one */
+    int gaps_sum;
+    int n_relief_steps; /* columns whose relief differs from their left one */
+
+    size_t size; /* bytes taken by the grid and its arrays */
 } grid_t;
 
+/* A grid and all its arrays take one contiguous block of grid_size() bytes,
+ * so grid_cpy is a single memcpy. grid_init lays a grid out in caller-owned
+ * memory, e.g. one slot of an array of grids.
+ */
+size_t grid_size(int height, int width);
+grid_t *grid_init(void *mem, int height, int width);
 grid_t *grid_new(int height, int width);
 void grid_cpy(grid_t *dest, const grid_t *src);
 void grid_block_add(grid_t *g, block_t *b);
@@ -69,19 +133,69 @@ void grid_block_move(grid_t *g, block_t *b, direction_t d, int amount);
 void grid_block_rotate(grid_t *g, block_t *b, int amount);
 int grid_clear_lines(grid_t *g);
 
+/* Occupy the cell at row r, column c, e.g. to load a recorded board */
+void grid_cell_set(grid_t *g, int r, int c);
+/* Replace the contents of g by n rows, from the bottom one */
+void grid_load_rows(grid_t *g, const row_t *rows, int n);
+
+/* Placements dropped from row y: the search works on these alone */
+bool grid_place_intersects(const grid_t *g, const placement_t *p, int y);
+int grid_place_drop(const grid_t *g, const placement_t *p, int y);
+int grid_place_drops(const grid_t *g,
+                     const shape_t *s,
+                     int y,
+                     int lo,
+                     int hi,
+                     int8_t land[4][GRID_ROW_BITS]);
+void grid_place_add(grid_t *g, const placement_t *p, int y);
+void grid_place_remove(grid_t *g, const placement_t *p, int y);
+
+/* Journal of one grid_clear_lines_undoable call, enough to put the cleared
+ * rows back with grid_clear_lines_undo. It holds the rows completed by a
+ * single block, so clear after every placement.
+ */
+typedef struct {
+    int n_cleared;
+    int full_rows[MAX_BLOCK_LEN];
+    int n_last_cleared;
+    uint64_t hash;
+} grid_undo_t;
+
+int grid_clear_lines_undoable(grid_t *g, grid_undo_t *u);
+void grid_clear_lines_undo(grid_t *g, const grid_undo_t *u);
+
 #define GRID_WIDTH 14
 #define GRID_HEIGHT 20
 
+/* Number of pieces known in advance, including the current one */
+#define SS_DEFAULT_LEN 3
+
+/* PCG32 generator. Every shape stream has its own, so that streams are
+ * reproducible from their seed and never contend with each other.
+ */
+typedef struct {
+    uint64_t state, inc;
+} rng_t;
+
+void rng_seed(rng_t *r, uint64_t seed);
+uint32_t rng_next(rng_t *r);
+uint32_t rng_range(rng_t *r, uint32_t s);
+
 typedef struct {
     uint8_t max_len;
     int iter;
     bool *defined;
-    shape_t **stream;
+    const shape_t **stream;
+
+    rng_t rng;
+    uint8_t *bag; /* shapes left in the current bag, if dealing from bags */
+    int bag_left;
 } shape_stream_t;
 
-shape_stream_t *shape_stream_new(void);
-shape_t *shape_stream_peek(shape_stream_t *stream, int idx);
-shape_t *shape_stream_pop(shape_stream_t *stream);
+/* With bag, deal the shapes as shuffled bags each holding every shape once */
+shape_stream_t *shape_stream_new(int max_len, uint64_t seed, bool bag);
+const shape_t *shape_stream_peek(shape_stream_t *stream, int idx);
+const shape_t *shape_stream_pop(shape_stream_t *stream);
 
 typedef enum {
     INPUT_INVALID,
@@ -98,8 +212,318 @@ void tui_refresh(void);
 void tui_quit(void);
 input_t tui_scankey(void);
 
+/* Output to the terminal, traces and clients, see io.c */
+bool write_all(int fd, const void *buf, size_t len);
+
+/* ANSI terminal renderer drawing only the cells changed since the last
+ * frame, see render.c
+ */
+typedef struct render render_t;
+
+render_t *render_new(int height, int width, int fd);
+void render_grid(render_t *r, const grid_t *g);
+void render_status(render_t *r, const char *fmt, ...);
+bool render_flush(render_t *r);
+void render_free(render_t *r);
+
+/* Weights of the evaluation features, as named in weights files */
+#define EVAL_N_WEIGHTS 6
+
 float *default_weights();
-move_t *best_move(grid_t *g, block_t *b, shape_stream_t *ss, float *w);
-void auto_play(float *w);
+const char *weight_name(int i);
+bool weights_load(const char *path, float *w);
+void weights_write(FILE *f, const float *w);
+float grid_eval(const grid_t *g, const float *weights);
+
+/* Score n boards from their relief and gaps vectors: board i has them at
+ * relief + i * stride and gaps + i * stride. The stride is EVAL_STRIDE(width)
+ * or more, with zeros past the width. Scores go to out[i] and match
+ * grid_eval. The kernel (AVX2, SSE4.1, NEON or scalar) is picked at startup.
+ */
+#define EVAL_LANES 16
+#define EVAL_STRIDE(width) (((width) + EVAL_LANES - 1) & ~(EVAL_LANES - 1))
+
+void eval_boards(const int16_t *relief,
+                 const int16_t *gaps,
+                 int width,
+                 int stride,
+                 size_t n,
+                 const float *w,
+                 float *out);
+const char *eval_kernel_name(void);
+bool eval_set_kernel(const char *name);
+
+/* Structure-of-arrays snapshots of up to cap boards, scored in one pass */
+typedef struct {
+    int width, stride;
+    size_t n, cap;
+    int16_t *relief, *gaps; /* cap * stride entries each */
+} eval_batch_t;
+
+eval_batch_t *eval_batch_new(int width, size_t cap, void *parent);
+size_t eval_batch_push(eval_batch_t *b, const grid_t *g);
+void grid_eval_batch(const float *w,
+                     const eval_batch_t *b,
+                     size_t n,
+                     float *out);
+move_t *best_move(grid_t *g, shape_stream_t *ss, float *w);
+
+/* A fixed pool of threads running batches of indexed tasks. The thread that
+ * calls pool_run is worker 0 and takes part in the batch.
+ */
+typedef struct pool pool_t;
+typedef void (*pool_fn_t)(void *arg, int worker, int task);
+
+pool_t *pool_new(int n_workers);
+int pool_size(const pool_t *p);
+void pool_run(pool_t *p, int n_tasks, pool_fn_t fn, void *arg);
+void pool_free(pool_t *p);
+
+#define PRUNE_DEPTHS 8
+
+typedef struct {
+    int width, height; /* of the board, 0 for GRID_WIDTH and GRID_HEIGHT */
+    int n_threads; /* split root placements over this many threads if > 1 */
+    int tt_bits;   /* transposition table of 2^tt_bits entries, 0 for none */
+    int preview;   /* pieces known in advance, 0 for SS_DEFAULT_LEN */
+    int beam_width; /* beam search keeping this many boards per level if > 0 */
+    bool batch_eval; /* score the leaves of a node together, by grid_eval_batch */
+    int budget_us; /* anytime search: deepen until this much time passed if > 0 */
+    bool ponder;   /* auto_play: search the next piece while one is animated */
+    uint64_t seed; /* of the shape stream, headless game i takes seed + i */
+    bool bag;      /* deal the shapes from shuffled bags */
+
+    /* Pruned search: at depth d, only search below the prune_top[d] best
+     * placements by their one-piece value, and those within prune_margin
+     * of the best, where nonzero. Depths past the array take its last entry.
+     * prune_check also runs the exhaustive search to count agreements.
+     */
+    int prune_top[PRUNE_DEPTHS];
+    float prune_margin;
+    bool prune_check;
+
+    /* Expectimax: score the boards past the preview by the average, over
+     * every shape, of the best one-piece value, for up to expect_nodes such
+     * chance nodes per move (0 for no bound). Past the bound, boards take
+     * their own value. The transposition table is not used with it.
+     */
+    bool expect;
+    int expect_nodes;
+} search_opts_t;
+
+/* Search instrumentation. Build with -DSEARCH_STATS=0 (make STATS=0) to
+ * compile the counters out.
+ */
+#ifndef SEARCH_STATS
+#define SEARCH_STATS 1
+#endif
+
+#if SEARCH_STATS
+#define STATS_ADD(st, field, n) ((st)->field += (n))
+#else
+#define STATS_ADD(st, field, n) ((void) 0)
+#endif
+
+/* Timeline spans of the search, the pool and the renderers, exported as
+ * Chrome trace events, see spans.c. Build with -DSEARCH_SPANS=1 (make
+ * SPANS=1) to compile them in.
+ */
+#ifndef SEARCH_SPANS
+#define SEARCH_SPANS 0
+#endif
+
+#if SEARCH_SPANS
+void span_begin(const char *name);
+void span_end(void);
+void span_thread(const char *name, int id);
+#define SPAN_BEGIN(name) span_begin(name)
+#define SPAN_END() span_end()
+#define SPAN_THREAD(name, id) span_thread(name, id)
+#else
+#define SPAN_BEGIN(name) ((void) 0)
+#define SPAN_END() ((void) 0)
+#define SPAN_THREAD(name, id) ((void) 0)
+#endif
+
+/* Write the spans recorded so far, false if built without them */
+bool spans_write(const char *path);
+
+#define STATS_DEPTHS 8        /* deeper nodes are counted with the last */
+#define STATS_TIME_BUCKETS 24 /* bucket i: moves of [2^i, 2^(i+1)) us */
+
+typedef struct {
+    uint64_t nodes[STATS_DEPTHS]; /* nodes expanded, by depth from the root */
+    uint64_t leaves;              /* boards evaluated */
+    uint64_t grid_cpys;
+    uint64_t clears; /* grid_clear_lines calls that cleared rows */
+    uint64_t intersect_tests, nocheck_skips;
+    uint64_t drops, drop_hits; /* landing rows of nodes, those reused */
+    uint64_t tt_probes, tt_hits, tt_stores, tt_overwrites;
+    uint64_t prune_evals, prune_cuts;  /* one-piece values, placements cut */
+    uint64_t prune_checks, prune_agree; /* moves the exhaustive search chose */
+    uint64_t expect_nodes, expect_hits, expect_cutoffs; /* chance nodes */
+    uint64_t n_moves, move_ns, move_ns_max; /* best_move wall time */
+    uint64_t move_hist[STATS_TIME_BUCKETS];
+} search_stats_t;
+
+void search_stats_merge(search_stats_t *dst, const search_stats_t *src);
+void search_stats_move(search_stats_t *st, int64_t ns);
+void search_stats_print(FILE *f, const search_stats_t *st);
+
+/* SIGUSR1 asks for a stats dump, to be served by the game loop */
+void stats_signal_init(void);
+bool stats_requested(void);
+
+/* Transposition table mapping (board hash, depth left) to subtree values */
+typedef struct tt tt_t;
+
+tt_t *tt_new(int bits, void *parent);
+void tt_new_search(tt_t *tt);
+bool tt_probe(tt_t *tt, uint64_t hash, int depth, float *value);
+void tt_store(tt_t *tt, uint64_t hash, int depth, float value);
+void tt_stats_add(const tt_t *tt, search_stats_t *st);
+
+/* Beam search: keeps the beam_width best boards at every level */
+typedef struct beam beam_t;
+
+beam_t *beam_new(int height, int width, int beam_width, void *parent);
+void beam_stats_add(const beam_t *bm, search_stats_t *st);
+float beam_search(beam_t *bm,
+                  grid_t *g,
+                  const shape_t **seq,
+                  int depth,
+                  const float *w,
+                  move_t *best);
+
+/* Per-search scratch state: one grid, block and move per lookahead level.
+ * A context serves one search at a time; use one context per concurrent
+ * search. opts may be NULL for a serial search.
+ */
+typedef struct search_ctx search_ctx_t;
+
+search_ctx_t *search_ctx_new(int height,
+                             int width,
+                             int max_depth,
+                             const search_opts_t *opts);
+void search_ctx_free(search_ctx_t *ctx);
+void search_ctx_stats(const search_ctx_t *ctx, search_stats_t *st);
+/* Value of the move the last search on ctx returned */
+float search_ctx_value(const search_ctx_t *ctx);
+move_t *best_move_ctx(search_ctx_t *ctx,
+                      grid_t *g,
+                      shape_stream_t *ss,
+                      float *w);
+move_t *best_move_seq(search_ctx_t *ctx,
+                      grid_t *g,
+                      const shape_t **seq,
+                      int n,
+                      float *w);
+
+/* Ask an anytime search running on ctx, from another thread, to return what
+ * it has found so far. The request holds until cleared with stop = false.
+ */
+void search_ctx_stop(search_ctx_t *ctx, bool stop);
+
+/* Pondering: search the next piece on the board the current move leads to,
+ * in a background thread, while the current piece is animated.
+ */
+typedef struct ponder ponder_t;
+
+ponder_t *ponder_new(int height,
+                     int width,
+                     int max_depth,
+                     const search_opts_t *opts,
+                     float *w);
+void ponder_start(ponder_t *p,
+                  const grid_t *g,
+                  const move_t *m,
+                  shape_stream_t *ss);
+bool ponder_finish(ponder_t *p, const grid_t *g, move_t *m);
+void ponder_stats(ponder_t *p, search_stats_t *st);
+void ponder_free(ponder_t *p);
+
+/* Binary game traces, recorded per piece and replayed from keyframes of the
+ * board without searching, see trace.c
+ */
+#define TRACE_SCORES 1    /* header flag: records carry the search score */
+#define TRACE_BAG 2       /* header flag: shapes were dealt from bags */
+#define TRACE_NEW_GAME 0x80 /* record rotation bit: first piece of a game */
+
+typedef struct trace trace_t;
+typedef struct trace_view trace_view_t;
+
+typedef struct {
+    int shape, rot, col, lines;
+    bool new_game;
+    float score; /* NAN if not recorded */
+} trace_rec_t;
+
+trace_t *trace_create(const char *path,
+                      int height,
+                      int width,
+                      uint64_t seed,
+                      bool bag,
+                      bool scores);
+void trace_game(trace_t *t);
+void trace_piece(trace_t *t,
+                 const grid_t *g,
+                 const shape_t *s,
+                 int rot,
+                 int col,
+                 int lines,
+                 float score);
+bool trace_close(trace_t *t);
+
+trace_view_t *trace_open(const char *path);
+void trace_view_close(trace_view_t *v);
+long trace_pieces(const trace_view_t *v);
+int trace_width(const trace_view_t *v);
+int trace_height(const trace_view_t *v);
+void trace_record(const trace_view_t *v, long n, trace_rec_t *rec);
+bool trace_seek(const trace_view_t *v,
+                long n,
+                grid_t *g,
+                int *game,
+                int *lines);
+bool trace_replay(const char *path, long seek);
+
+void auto_play(float *w, const search_opts_t *opts, trace_t *rec);
+
+typedef struct {
+    int n_pieces, n_lines;
+    search_stats_t search;
+} game_stats_t;
+
+/* With a renderer, headless games are drawn as they go, and with a trace
+ * recorded. With dumps, SIGUSR1 prints the search stats of the game so far;
+ * drivers of concurrent games serve it themselves.
+ */
+void headless_game(float *w,
+                   const search_opts_t *opts,
+                   int max_pieces,
+                   render_t *view,
+                   trace_t *rec,
+                   bool dumps,
+                   game_stats_t *st);
+void headless_play(float *w,
+                   const search_opts_t *opts,
+                   int n_games,
+                   int max_pieces,
+                   bool watch,
+                   trace_t *rec);
+
+/* Play n_games headless games over n_jobs threads, see batch.c */
+bool batch_play(float *w,
+                const search_opts_t *opts,
+                int n_games,
+                int max_pieces,
+                int n_jobs,
+                const char *csv_file,
+                const char *json_file,
+                const char *record_file);
+
+/* Answer best-move requests over stdin and stdout, or TCP, see server.c */
+void serve_stdio(const float *w, const search_opts_t *opts);
+bool serve_tcp(const float *w, const search_opts_t *opts, int port);
 
 void free_shape(void);
\ No newline at end of file
@@ -0,0 +1,408 @@
+/*
+ * Binary game traces: one fixed-width record per piece, grouped into blocks
+ * that each start with a keyframe of the board, so any piece is reached by
+ * replaying at most one block of placements and never the search.
+ *
+ *   header    trace_header_t
+ *   block 0   keyframe, then keyframe_every records
+ *   block 1   keyframe, then keyframe_every records
+ *   ...       the last block may hold fewer records
+ *
+ * A keyframe holds the number of games started so far, the lines cleared in
+ * the current game, and the rows of the board from the bottom, one uint64_t
+ * each. A record holds the shape index, the rotation with TRACE_NEW_GAME in
+ * its top bit, the column and the lines cleared, followed by the search
+ * score as a float when the header has TRACE_SCORES. Blocks have a fixed
+ * size and stay 8-byte aligned, so a mapped file is indexed directly and the
+ * number of pieces follows from the file size. Fields are in host byte
+ * order.
+ */
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "nalloc.h"
+#include "tetris.h"
+
+#define TRACE_MAGIC "ATRC"
+#define TRACE_VERSION 1
+#define TRACE_KEYFRAME_EVERY 256
+#define TRACE_BUF (64 * 1024)
+
+typedef struct {
+    char magic[4];
+    uint8_t version, width, height, flags;
+    uint32_t keyframe_every; /* records per block, even */
+    uint32_t n_shapes;
+    uint64_t seed;
+} trace_header_t;
+
+_Static_assert(sizeof(trace_header_t) == 24, "trace header layout");
+
+typedef struct {
+    uint32_t game;  /* games started before the block */
+    uint32_t lines; /* cleared in that game before the block */
+    uint64_t rows[];
+} trace_keyframe_t;
+
+struct trace {
+    int fd;
+    trace_header_t h;
+    size_t rec_size;
+    long n_pieces;
+    uint32_t game, lines;
+    bool new_game;
+    bool ok;
+
+    char buf[TRACE_BUF];
+    size_t len;
+};
+
+struct trace_view {
+    const uint8_t *base;
+    size_t size;
+    trace_header_t h;
+    size_t rec_size, kf_size, block_size;
+    long n_pieces;
+};
+
+static void trace_flush(trace_t *t)
+{
+    if (t->ok && !write_all(t->fd, t->buf, t->len))
+        t->ok = false;
+    t->len = 0;
+}
+
+static void trace_put(trace_t *t, const void *p, size_t n)
+{
+    if (t->len + n > sizeof(t->buf))
+        trace_flush(t);
+    memcpy(t->buf + t->len, p, n);
+    t->len += n;
+}
+
+static void trace_keyframe(trace_t *t, const grid_t *g)
+{
+    uint32_t head[2] = {t->game, t->lines};
+    trace_put(t, head, sizeof(head));
+    for (int r = 0; r < t->h.height; r++) {
+        uint64_t row = g ? g->rows[r] : 0;
+        trace_put(t, &row, sizeof(row));
+    }
+}
+
+/* Start a trace of games on a height x width board */
+trace_t *trace_create(const char *path,
+                      int height,
+                      int width,
+                      uint64_t seed,
+                      bool bag,
+                      bool scores)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0)
+        return NULL;
+
+    trace_t *t = ncalloc(1, sizeof(*t), NULL);
+    t->fd = fd;
+    t->ok = true;
+    memcpy(t->h.magic, TRACE_MAGIC, 4);
+    t->h.version = TRACE_VERSION;
+    t->h.width = width;
+    t->h.height = height;
+    t->h.flags = (scores ? TRACE_SCORES : 0) | (bag ? TRACE_BAG : 0);
+    t->h.keyframe_every = TRACE_KEYFRAME_EVERY;
+    t->h.n_shapes = shapes_count();
+    t->h.seed = seed;
+    t->rec_size = scores ? 8 : 4;
+
+    trace_put(t, &t->h, sizeof(t->h));
+    trace_keyframe(t, NULL);
+    return t;
+}
+
+/* The next piece starts a new game, on an empty board */
+void trace_game(trace_t *t)
+{
+    if (!t)
+        return;
+    t->new_game = true;
+}
+
+/* Record a piece placed at (rot, col). g is the board once the piece is
+ * placed and lines it completed are cleared.
+ */
+void trace_piece(trace_t *t,
+                 const grid_t *g,
+                 const shape_t *s,
+                 int rot,
+                 int col,
+                 int lines,
+                 float score)
+{
+    if (!t)
+        return;
+
+    if (t->new_game) {
+        t->game++;
+        t->lines = 0;
+    }
+    uint8_t rec[8] = {
+        s - shape_get(0),
+        rot | (t->new_game ? TRACE_NEW_GAME : 0),
+        col,
+        lines,
+    };
+    memcpy(rec + 4, &score, sizeof(score));
+    trace_put(t, rec, t->rec_size);
+    t->new_game = false;
+    t->lines += lines;
+
+    /* The keyframe of the next block is the board this piece left */
+    if (++t->n_pieces % t->h.keyframe_every == 0)
+        trace_keyframe(t, g);
+}
+
+/* Flush and close the trace, and tell whether every write succeeded */
+bool trace_close(trace_t *t)
+{
+    if (!t)
+        return true;
+    trace_flush(t);
+    bool ok = t->ok;
+    ok &= !close(t->fd);
+    nfree(t);
+    return ok;
+}
+
+trace_view_t *trace_open(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(trace_header_t)) {
+        close(fd);
+        return NULL;
+    }
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    trace_view_t *v = ncalloc(1, sizeof(*v), NULL);
+    v->base = base;
+    v->size = st.st_size;
+    memcpy(&v->h, base, sizeof(v->h));
+    v->rec_size = v->h.flags & TRACE_SCORES ? 8 : 4;
+    v->kf_size = sizeof(trace_keyframe_t) + v->h.height * sizeof(uint64_t);
+    v->block_size = v->kf_size + v->h.keyframe_every * v->rec_size;
+
+    if (memcmp(v->h.magic, TRACE_MAGIC, 4) ||
+        v->h.version != TRACE_VERSION || !v->h.keyframe_every ||
+        v->h.height > GRID_MAX_HEIGHT || v->h.width > GRID_ROW_BITS ||
+        v->size < sizeof(v->h) + v->kf_size) {
+        trace_view_close(v);
+        return NULL;
+    }
+
+    /* A trace cut short counts only its whole records */
+    size_t body = v->size - sizeof(v->h);
+    size_t tail = body % v->block_size;
+    v->n_pieces = (long) (body / v->block_size) * v->h.keyframe_every;
+    if (tail >= v->kf_size)
+        v->n_pieces += (tail - v->kf_size) / v->rec_size;
+    return v;
+}
+
+void trace_view_close(trace_view_t *v)
+{
+    if (!v)
+        return;
+    munmap((void *) v->base, v->size);
+    nfree(v);
+}
+
+long trace_pieces(const trace_view_t *v)
+{
+    return v->n_pieces;
+}
+
+int trace_width(const trace_view_t *v)
+{
+    return v->h.width;
+}
+
+int trace_height(const trace_view_t *v)
+{
+    return v->h.height;
+}
+
+static const trace_keyframe_t *view_keyframe(const trace_view_t *v, long blk)
+{
+    return (const void *) (v->base + sizeof(v->h) + blk * v->block_size);
+}
+
+/* Record n, which must be below trace_pieces */
+void trace_record(const trace_view_t *v, long n, trace_rec_t *rec)
+{
+    long every = v->h.keyframe_every;
+    const uint8_t *p = (const uint8_t *) view_keyframe(v, n / every) +
+                       v->kf_size + (n % every) * v->rec_size;
+    rec->shape = p[0];
+    rec->rot = p[1] & ~TRACE_NEW_GAME;
+    rec->new_game = p[1] & TRACE_NEW_GAME;
+    rec->col = p[2];
+    rec->lines = p[3];
+    rec->score = NAN;
+    if (v->rec_size == 8)
+        memcpy(&rec->score, p + 4, sizeof(rec->score));
+}
+
+/* Put g, a board of the trace's size, in the state before piece n, 0 to
+ * trace_pieces, and tell the game it belongs to (0-based) and the lines
+ * cleared in that game so far. Fails if the trace does not replay, as when
+ * it was recorded with another shape set, or holds records or keyframes
+ * out of bounds.
+ */
+bool trace_seek(const trace_view_t *v,
+                long n,
+                grid_t *g,
+                int *game,
+                int *lines)
+{
+    if (n < 0 || n > v->n_pieces || (int) v->h.n_shapes != shapes_count() ||
+        g->width != v->h.width || g->height != v->h.height)
+        return false;
+
+    /* A trace cut right after a block has no keyframe for the next one, so
+     * replay the whole block before it
+     */
+    long every = v->h.keyframe_every, first = n - n % every;
+    size_t kf_at = sizeof(v->h) + (size_t) (first / every) * v->block_size;
+    if (kf_at + v->kf_size > v->size && first >= every) {
+        first -= every;
+        kf_at -= v->block_size;
+    }
+    if (kf_at + v->kf_size > v->size)
+        return false;
+    const trace_keyframe_t *kf = view_keyframe(v, first / every);
+    row_t rows[GRID_MAX_HEIGHT];
+    for (int r = 0; r < v->h.height; r++)
+        rows[r] = kf->rows[r];
+    grid_load_rows(g, rows, v->h.height);
+    int n_games = kf->game, n_lines = kf->lines;
+
+    block_t *b = block_new();
+    bool ok = true;
+    for (long i = first; ok && i < n; i++) {
+        trace_rec_t rec;
+        trace_record(v, i, &rec);
+        if (rec.new_game) {
+            grid_load_rows(g, NULL, 0);
+            n_games++;
+            n_lines = 0;
+        }
+        /* Corrupt records must not index past the placement tables */
+        const shape_t *s = rec.shape < shapes_count() ? shape_get(rec.shape)
+                                                      : NULL;
+        ok = s && rec.rot < s->n_rot &&
+             rec.col + s->rot_wh[rec.rot].x <= g->width;
+        if (!ok)
+            break;
+        block_init(b, s);
+        grid_block_center_elevate(g, b);
+        b->rot = rec.rot;
+        b->offset.x = rec.col;
+        grid_block_drop(g, b);
+        grid_block_add(g, b);
+        ok = grid_clear_lines(g) == rec.lines;
+        n_lines += rec.lines;
+    }
+    nfree(b);
+
+    /* A piece starting a game is shown on its empty board */
+    if (n < v->n_pieces) {
+        trace_rec_t rec;
+        trace_record(v, n, &rec);
+        if (rec.new_game) {
+            grid_load_rows(g, NULL, 0);
+            n_games++;
+            n_lines = 0;
+        }
+    }
+    if (game)
+        *game = n_games - 1;
+    if (lines)
+        *lines = n_lines;
+    return ok;
+}
+
+/* Summarize a trace, per game, or show the board before piece seek */
+bool trace_replay(const char *path, long seek)
+{
+    trace_view_t *v = trace_open(path);
+    if (!v) {
+        fprintf(stderr, "Failed to open trace %s\n", path);
+        return false;
+    }
+    long n = trace_pieces(v);
+
+    if (seek < 0) {
+        printf("trace %dx%d seed %llu%s: pieces %ld\n", v->h.width,
+               v->h.height, (unsigned long long) v->h.seed,
+               v->h.flags & TRACE_BAG ? " bag" : "", n);
+        long pieces = 0, lines = 0;
+        int game = 0;
+        for (long i = 0; i < n; i++) {
+            trace_rec_t rec;
+            trace_record(v, i, &rec);
+            if (rec.new_game && pieces) {
+                printf("game %d: lines %ld pieces %ld\n", game, lines,
+                       pieces);
+                pieces = lines = 0;
+            }
+            game += rec.new_game;
+            pieces++;
+            lines += rec.lines;
+        }
+        if (pieces)
+            printf("game %d: lines %ld pieces %ld\n", game, lines, pieces);
+        trace_view_close(v);
+        return true;
+    }
+
+    grid_t *g = grid_new(v->h.height, v->h.width);
+    int game, lines;
+    bool ok = trace_seek(v, seek, g, &game, &lines);
+    if (!ok) {
+        fprintf(stderr,
+                "Trace %s is corrupt or does not replay to piece %ld of %ld\n",
+                path, seek, n);
+    } else {
+        printf("piece %ld of %ld: game %d lines %d", seek, n, game + 1,
+               lines);
+        if (seek < n) {
+            trace_rec_t rec;
+            trace_record(v, seek, &rec);
+            printf(", next shape %d rot %d col %d clears %d", rec.shape,
+                   rec.rot, rec.col, rec.lines);
+            if (!isnan(rec.score))
+                printf(" score %.6g", rec.score);
+        }
+        printf("\n");
+        for (int r = g->height - 1; r >= 0; r--) {
+            for (int c = 0; c < g->width; c++)
+                putchar((g->rows[r] >> c) & 1 ? '#' : '.');
+            putchar('\n');
+        }
+    }
+    nfree(g);
+    trace_view_close(v);
+    return ok;
+}
@@ -0,0 +1,436 @@
+/*
+ * Self-play trainer of the evaluation weights, built by `make train`.
+ *
+ * It runs the cross-entropy method, a population-based optimizer close to a
+ * CMA-ES with a diagonal covariance: every generation samples candidates from
+ * a Gaussian around the mean weights, scores each one by the lines it clears
+ * in headless games, and refits the Gaussian to the best quarter of them.
+ * All candidates of a generation play the same seeds, and the games of the
+ * whole generation are spread over a pool of threads.
+ *
+ * The best candidate of a generation was picked on that generation's seeds,
+ * so its score there is biased upwards. Before it replaces the best weights
+ * so far, it is scored again on validation seeds, the same for every
+ * generation and never used to rank candidates, and only that score is
+ * compared across generations.
+ *
+ * The evaluation is linear in the weights, so only their direction changes
+ * the moves: candidates are kept at unit length.
+ */
+
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tetris.h"
+
+#define N_W EVAL_N_WEIGHTS
+
+typedef struct {
+    int generation; /* the last one completed */
+    uint64_t seed;
+    float mean[N_W], sigma[N_W];
+    float best[N_W];
+    double best_fitness; /* on the validation seeds */
+} train_state_t;
+
+typedef struct {
+    float w[N_W];
+    double fitness;
+} candidate_t;
+
+typedef struct {
+    candidate_t *cands;
+    int *lines; /* per candidate, per game */
+    int n_games, max_pieces;
+    search_opts_t opts;
+    uint64_t gen_seed;
+    uint64_t val_seed; /* of the validation games */
+} generation_t;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void normalize(float *w)
+{
+    double norm = 0;
+    for (int i = 0; i < N_W; i++)
+        norm += (double) w[i] * w[i];
+    norm = sqrt(norm);
+    if (norm > 0) {
+        for (int i = 0; i < N_W; i++)
+            w[i] /= norm;
+    }
+}
+
+/* Standard normal deviate, by Box-Muller */
+static double gaussian(rng_t *r)
+{
+    double u1 = (rng_next(r) + 1.0) / 4294967296.0;
+    double u2 = rng_next(r) / 4294967296.0;
+    return sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+}
+
+static void play_task(void *arg, int worker, int task)
+{
+    (void) worker;
+    generation_t *gen = arg;
+    int cand = task / gen->n_games, game = task % gen->n_games;
+
+    search_opts_t opts = gen->opts;
+    opts.seed = gen->gen_seed + game;
+    game_stats_t st;
+    headless_game(gen->cands[cand].w, &opts, gen->max_pieces, NULL, NULL,
+                  false, &st);
+    gen->lines[task] = st.n_lines;
+}
+
+/* Mean lines per game of w over the validation seeds */
+static double validate(pool_t *pool, const generation_t *gen, const float *w)
+{
+    candidate_t cand;
+    memcpy(cand.w, w, sizeof(cand.w));
+    generation_t val = *gen;
+    val.cands = &cand;
+    val.lines = calloc(gen->n_games, sizeof(int));
+    val.gen_seed = gen->val_seed;
+    pool_run(pool, gen->n_games, play_task, &val);
+
+    long sum = 0;
+    for (int j = 0; j < gen->n_games; j++)
+        sum += val.lines[j];
+    free(val.lines);
+    return (double) sum / gen->n_games;
+}
+
+static int by_fitness(const void *a, const void *b)
+{
+    double fa = ((const candidate_t *) a)->fitness;
+    double fb = ((const candidate_t *) b)->fitness;
+    return (fa < fb) - (fa > fb);
+}
+
+static void print_weights(FILE *f, const char *prefix, const float *w)
+{
+    fprintf(f, "%s", prefix);
+    for (int i = 0; i < N_W; i++)
+        fprintf(f, " %s %.4f", weight_name(i), w[i]);
+    fprintf(f, "\n");
+}
+
+static void read_vec(const char *s, float *v)
+{
+    for (int i = 0; i < N_W; i++)
+        v[i] = strtof(s, (char **) &s);
+}
+
+static void write_vec(FILE *f, const char *key, const float *v)
+{
+    fprintf(f, "%s", key);
+    for (int i = 0; i < N_W; i++)
+        fprintf(f, " %.9g", v[i]);
+    fprintf(f, "\n");
+}
+
+/* Checkpoints are replaced atomically, by renaming, so that a run killed
+ * while saving keeps the previous one.
+ */
+static bool checkpoint_save(const char *path, const train_state_t *ts)
+{
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "w");
+    if (!f)
+        return false;
+
+    fprintf(f, "# tetris-train checkpoint\n");
+    fprintf(f, "generation %d\n", ts->generation);
+    fprintf(f, "seed %llu\n", (unsigned long long) ts->seed);
+    fprintf(f, "best_fitness %.17g\n", ts->best_fitness);
+    write_vec(f, "mean", ts->mean);
+    write_vec(f, "sigma", ts->sigma);
+    write_vec(f, "best", ts->best);
+
+    bool ok = !ferror(f);
+    ok &= !fclose(f);
+    return ok && !rename(tmp, path);
+}
+
+static bool checkpoint_load(const char *path, train_state_t *ts)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return false;
+
+    char line[1024], key[32];
+    int n_keys = 0, off;
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '#' || sscanf(line, "%31s%n", key, &off) != 1)
+            continue;
+        const char *val = line + off;
+        n_keys++;
+        if (!strcmp(key, "generation"))
+            ts->generation = atoi(val);
+        else if (!strcmp(key, "seed"))
+            ts->seed = strtoull(val, NULL, 0);
+        else if (!strcmp(key, "best_fitness"))
+            ts->best_fitness = strtod(val, NULL);
+        else if (!strcmp(key, "mean"))
+            read_vec(val, ts->mean);
+        else if (!strcmp(key, "sigma"))
+            read_vec(val, ts->sigma);
+        else if (!strcmp(key, "best"))
+            read_vec(val, ts->best);
+        else
+            n_keys--;
+    }
+    fclose(f);
+    return n_keys == 6;
+}
+
+static bool weights_save(const char *path, const train_state_t *ts)
+{
+    FILE *f = fopen(path, "w");
+    if (!f)
+        return false;
+    fprintf(f, "# tetris-train, generation %d seed %llu: %.1f lines/game\n",
+            ts->generation, (unsigned long long) ts->seed, ts->best_fitness);
+    weights_write(f, ts->best);
+    return !fclose(f);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --generations N   generations to run (default 50)\n"
+            "  --population N    candidates per generation (default 32)\n"
+            "  --games N         games per candidate (default 16)\n"
+            "  --max-pieces N    stop a game after N pieces (default 5000)\n"
+            "  --preview N       pieces known in advance (default 1)\n"
+            "  --bag             deal the shapes from shuffled bags\n"
+            "  --threads N       threads playing games (default: all cores)\n"
+            "  --seed S          seed of the games and the sampling "
+            "(default 1)\n"
+            "  --sigma X         initial spread of the candidates "
+            "(default 0.1)\n"
+            "  --weights FILE    start from the weights in FILE\n"
+            "  --checkpoint FILE save the state there every generation "
+            "(default\n"
+            "                    train.ckpt)\n"
+            "  --resume          continue from the checkpoint\n"
+            "  --out FILE        write the best weights to FILE (default "
+            "weights.txt)\n"
+            "  --help            show this message\n",
+            prog);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option opts[] = {
+        {"generations", required_argument, NULL, 'n'},
+        {"population", required_argument, NULL, 'l'},
+        {"games", required_argument, NULL, 'g'},
+        {"max-pieces", required_argument, NULL, 'p'},
+        {"preview", required_argument, NULL, 'P'},
+        {"bag", no_argument, NULL, 'G'},
+        {"threads", required_argument, NULL, 't'},
+        {"seed", required_argument, NULL, 's'},
+        {"sigma", required_argument, NULL, 'x'},
+        {"weights", required_argument, NULL, 'W'},
+        {"checkpoint", required_argument, NULL, 'c'},
+        {"resume", no_argument, NULL, 'r'},
+        {"out", required_argument, NULL, 'o'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int n_gens = 50, n_cands = 32, n_games = 16, max_pieces = 5000;
+    int n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    float sigma0 = 0.1;
+    bool resume = false;
+    const char *weights_file = NULL, *ckpt_file = "train.ckpt";
+    const char *out_file = "weights.txt";
+    search_opts_t game_opts = {.n_threads = 1, .preview = 1};
+    train_state_t ts = {.generation = 0, .seed = 1, .best_fitness = -1};
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+        switch (opt) {
+        case 'n':
+            n_gens = atoi(optarg);
+            break;
+        case 'l':
+            n_cands = atoi(optarg);
+            break;
+        case 'g':
+            n_games = atoi(optarg);
+            break;
+        case 'p':
+            max_pieces = atoi(optarg);
+            break;
+        case 'P':
+            game_opts.preview = atoi(optarg);
+            break;
+        case 'G':
+            game_opts.bag = true;
+            break;
+        case 't':
+            n_threads = atoi(optarg);
+            break;
+        case 's':
+            ts.seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'x':
+            sigma0 = atof(optarg);
+            break;
+        case 'W':
+            weights_file = optarg;
+            break;
+        case 'c':
+            ckpt_file = optarg;
+            break;
+        case 'r':
+            resume = true;
+            break;
+        case 'o':
+            out_file = optarg;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (n_cands < 4 || n_games < 1 || n_threads < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (!shapes_init(NULL)) {
+        fprintf(stderr, "Failed to load shapes\n");
+        return 1;
+    }
+
+    float *w = default_weights();
+    if (weights_file && !weights_load(weights_file, w)) {
+        fprintf(stderr, "Failed to load weights from %s\n", weights_file);
+        return 1;
+    }
+    normalize(w);
+    memcpy(ts.mean, w, sizeof(ts.mean));
+    memcpy(ts.best, w, sizeof(ts.best));
+    for (int i = 0; i < N_W; i++)
+        ts.sigma[i] = sigma0;
+    free(w);
+
+    if (resume) {
+        if (!checkpoint_load(ckpt_file, &ts)) {
+            fprintf(stderr, "Failed to resume from %s\n", ckpt_file);
+            return 1;
+        }
+        printf("resuming after generation %d\n", ts.generation);
+    }
+
+    int n_elite = n_cands / 4;
+    generation_t gen = {
+        .cands = calloc(n_cands, sizeof(candidate_t)),
+        .lines = calloc(n_cands * n_games, sizeof(int)),
+        .n_games = n_games,
+        .max_pieces = max_pieces,
+        .opts = game_opts,
+        /* Generation g plays from seed + (g << 32), so g = 0 is free */
+        .val_seed = ts.seed,
+    };
+    pool_t *pool = pool_new(n_threads);
+
+    /* A fresh run keeps its starting weights unless a candidate beats them */
+    if (!resume)
+        ts.best_fitness = validate(pool, &gen, ts.best);
+
+    while (ts.generation < n_gens) {
+        int g = ts.generation + 1;
+        double start = now();
+
+        /* Candidate 0 is the mean itself. Sampling only depends on the seed
+         * and the generation, so a resumed run repeats an uninterrupted one.
+         */
+        rng_t rng;
+        rng_seed(&rng, ts.seed ^ (uint64_t) g << 32);
+        for (int c = 0; c < n_cands; c++) {
+            for (int i = 0; i < N_W; i++)
+                gen.cands[c].w[i] =
+                    ts.mean[i] + (c ? ts.sigma[i] * gaussian(&rng) : 0);
+            normalize(gen.cands[c].w);
+        }
+
+        gen.gen_seed = ts.seed + ((uint64_t) g << 32);
+        pool_run(pool, n_cands * n_games, play_task, &gen);
+
+        for (int c = 0; c < n_cands; c++) {
+            long sum = 0;
+            for (int j = 0; j < n_games; j++)
+                sum += gen.lines[c * n_games + j];
+            gen.cands[c].fitness = (double) sum / n_games;
+        }
+        double mean_fitness = gen.cands[0].fitness;
+        qsort(gen.cands, n_cands, sizeof(*gen.cands), by_fitness);
+
+        /* Refit the Gaussian to the elite, with a floor on the spread so
+         * that it does not collapse before the elite agrees.
+         */
+        double elite_fitness = 0;
+        for (int i = 0; i < N_W; i++) {
+            double m = 0, v = 0;
+            for (int c = 0; c < n_elite; c++)
+                m += gen.cands[c].w[i];
+            m /= n_elite;
+            for (int c = 0; c < n_elite; c++)
+                v += (gen.cands[c].w[i] - m) * (gen.cands[c].w[i] - m);
+            ts.mean[i] = m;
+            ts.sigma[i] = sqrt(v / n_elite + 1e-6);
+        }
+        normalize(ts.mean);
+        for (int c = 0; c < n_elite; c++)
+            elite_fitness += gen.cands[c].fitness / n_elite;
+
+        double val_fitness = validate(pool, &gen, gen.cands[0].w);
+        if (val_fitness > ts.best_fitness) {
+            ts.best_fitness = val_fitness;
+            memcpy(ts.best, gen.cands[0].w, sizeof(ts.best));
+        }
+        ts.generation = g;
+
+        printf("gen %d: best %.1f (validation %.1f) elite %.1f mean %.1f "
+               "lines/game, %.1fs\n",
+               g, gen.cands[0].fitness, val_fitness, elite_fitness,
+               mean_fitness, now() - start);
+        print_weights(stdout, "  best", gen.cands[0].w);
+        fflush(stdout);
+
+        if (!checkpoint_save(ckpt_file, &ts))
+            fprintf(stderr, "Failed to save checkpoint %s\n", ckpt_file);
+        if (!weights_save(out_file, &ts))
+            fprintf(stderr, "Failed to write weights to %s\n", out_file);
+    }
+
+    printf("best: %.1f lines/game, written to %s\n", ts.best_fitness,
+           out_file);
+    print_weights(stdout, "  weights", ts.best);
+
+    pool_free(pool);
+    free(gen.cands);
+    free(gen.lines);
+    free_shape();
+    return 0;
+}
@@ -0,0 +1,81 @@
+/*
+ * Transposition table for the lookahead search.
+ *
+ * A fixed-size, direct-mapped table from (board hash, remaining depth) to
+ * the value of the subtree below that board. Entries carry the generation of
+ * the search that stored them: the subtree value depends on the preview, so
+ * starting a new search implicitly invalidates everything stored before.
+ */
+
+#include "nalloc.h"
+#include "tetris.h"
+
+typedef struct {
+    uint64_t hash;
+    float value;
+    uint16_t gen;
+    int16_t depth;
+} tt_entry_t;
+
+struct tt {
+    tt_entry_t *entries;
+    uint64_t mask;
+    uint16_t gen;
+    uint64_t probes, hits, stores, overwrites;
+};
+
+tt_t *tt_new(int bits, void *parent)
+{
+    tt_t *tt = ncalloc(1, sizeof(*tt), parent);
+    tt->mask = ((uint64_t) 1 << bits) - 1;
+    tt->entries = ncalloc(tt->mask + 1, sizeof(*tt->entries), tt);
+    tt->gen = 1;
+    return tt;
+}
+
+void tt_new_search(tt_t *tt)
+{
+    /* Generation 0 marks never written entries */
+    if (!++tt->gen) {
+        for (uint64_t i = 0; i <= tt->mask; i++)
+            tt->entries[i].gen = 0;
+        tt->gen = 1;
+    }
+}
+
+static inline tt_entry_t *tt_slot(tt_t *tt, uint64_t hash, int depth)
+{
+    return &tt->entries[(hash ^ (uint64_t) depth * 0x9e3779b97f4a7c15ULL) &
+                        tt->mask];
+}
+
+bool tt_probe(tt_t *tt, uint64_t hash, int depth, float *value)
+{
+    tt_entry_t *e = tt_slot(tt, hash, depth);
+    STATS_ADD(tt, probes, 1);
+    if (e->gen != tt->gen || e->hash != hash || e->depth != depth)
+        return false;
+    STATS_ADD(tt, hits, 1);
+    *value = e->value;
+    return true;
+}
+
+void tt_store(tt_t *tt, uint64_t hash, int depth, float value)
+{
+    tt_entry_t *e = tt_slot(tt, hash, depth);
+    STATS_ADD(tt, stores, 1);
+    if (e->gen == tt->gen)
+        STATS_ADD(tt, overwrites, 1);
+    e->hash = hash;
+    e->value = value;
+    e->gen = tt->gen;
+    e->depth = depth;
+}
+
+void tt_stats_add(const tt_t *tt, search_stats_t *st)
+{
+    st->tt_probes += tt->probes;
+    st->tt_hits += tt->hits;
+    st->tt_stores += tt->stores;
+    st->tt_overwrites += tt->overwrites;
+}
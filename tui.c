@@ -20,7 +20,7 @@ void tui_grid_print(const grid_t *g)
 {
     for (int row = g->height - 1; row >= 0; row--) {
         for (int col = 0; col < g->width; col++)
-            tui_paint(g->height - 1 - row, col, g->rows[row][col]);
+            tui_paint(g->height - 1 - row, col, (g->rows[row] >> col) & 1);
     }
 }
 
@@ -90,8 +90,10 @@ void tui_setup(const grid_t *g)
 
 void tui_refresh(void)
 {
+    SPAN_BEGIN("render");
     wrefresh(stdscr);
     wrefresh(win);
+    SPAN_END();
 }
 
 void tui_quit(void)